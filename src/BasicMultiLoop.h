@@ -0,0 +1,153 @@
+#pragma once
+
+#include "debug.h"
+#include <algorithm>
+#include <limits>
+#include <span>
+#include <utility>
+#include <vector>
+
+// The MultiLoop state machine (see utils/MultiLoop.h and multiloop_test.cxx), for a
+// given container of loop counters: std::array<int, N> when the number of loops is
+// known at compile time (so that the compiler can keep the state in registers and
+// fold inner_loop()), or std::vector<int>.
+//
+// Apart from the MultiLoop interface, the state can be exported (counters(),
+// current_loop() and finished()) and imported again (set_state()) at the top of a
+// loop body; that is all that is needed to checkpoint or split an enumeration.
+template<typename Counters>
+class BasicMultiLoop
+{
+ protected:
+  Counters m_counters;
+  int m_current_loop;           // The loop that we are currently in, in the range [0, number_of_loops()>.
+  int m_breaks;                 // The argument of the last call to breaks(), or -1.
+  bool m_finished;
+
+  BasicMultiLoop(Counters counters, int b) :
+    m_counters(std::move(counters)), m_current_loop(0), m_breaks(-1), m_finished(m_counters.size() == 0)
+  {
+    if (!m_finished)
+      m_counters[0] = b;
+  }
+
+ public:
+  int number_of_loops() const { return m_counters.size(); }
+
+  // Value of the counter of the current loop.
+  int operator()() const { return m_counters[m_current_loop]; }
+  // The current loop number.
+  unsigned int operator*() const { return m_current_loop; }
+
+  bool inner_loop() const { return m_current_loop == number_of_loops() - 1; }
+  bool finished() const { return m_finished; }
+
+  // Break out of n loops; n == 0 means 'continue'.
+  void breaks(int n) { m_breaks = n; }
+
+  // Start the next loop at b, or increment the counter if this is the inner loop.
+  void start_next_loop_at(int b)
+  {
+    if (inner_loop())
+      ++m_counters[m_current_loop];
+    else
+      m_counters[++m_current_loop] = b;
+  }
+
+  // Returns the loop number whose body continues after the loop that just ended, or -1.
+  int end_of_loop()
+  {
+    int n = m_breaks;
+    m_breaks = -1;
+    if (n == 0)
+    {
+      ++m_counters[m_current_loop];
+      return -1;
+    }
+    m_current_loop -= n > 0 ? n : 1;
+    if (m_current_loop < 0)
+    {
+      m_finished = true;
+      return -1;
+    }
+    ++m_counters[m_current_loop];
+    return m_current_loop;
+  }
+
+  void next_loop() { }
+
+  // Export of the state.
+  std::span<int const> counters() const { return m_counters; }
+  int current_loop() const { return m_current_loop; }
+
+  // Import of a state that was exported at the top of a loop body. The number of counters must be equal to number_of_loops(),
+  // unless Counters can be resized.
+  void set_state(std::span<int const> counters, int current_loop, bool finished)
+  {
+    if constexpr (requires { m_counters.resize(0); })
+      m_counters.resize(counters.size());
+    ASSERT(counters.size() == m_counters.size() && 0 <= current_loop && current_loop < number_of_loops());
+    std::copy(counters.begin(), counters.end(), m_counters.begin());
+    m_current_loop = current_loop;
+    m_breaks = -1;
+    m_finished = finished;
+  }
+};
+
+// A MultiLoop that runs only the iterations [begin, end> of the loop at depth `depth`,
+// for given values of the counters of the loops outside of it (prefix, the counters
+// of loops 0 .. depth-1), including everything inside those iterations. The loop body
+// is the same as that of a serial run; splitting the range of a loop into slices and
+// running the slices gives, concatenated in order, the output of the serial run of
+// that loop.
+//
+// The loop at depth starts at begin (no iterations are skipped). Its end is enforced
+// through operator(): once the counter of that loop reached end, operator() returns
+// INT_MAX at that depth, so that the loop condition `ml() < limit` fails.
+//
+// If the body breaks out of the loop at depth (or a loop outside of it) then the slice
+// finishes and broke_out() returns true: in the serial run the iterations after the
+// break would not have been executed, so the output of the slices after it must be
+// discarded.
+class MultiLoopSlice : public BasicMultiLoop<std::vector<int>>
+{
+ private:
+  int m_depth;
+  int m_end;
+  bool m_broke_out = false;
+
+ public:
+  MultiLoopSlice(int number_of_loops, int depth, std::span<int const> prefix, int begin, int end) :
+    BasicMultiLoop(std::vector<int>(number_of_loops), 0), m_depth(depth), m_end(end)
+  {
+    ASSERT(0 <= depth && depth < number_of_loops && prefix.size() == static_cast<size_t>(depth));
+    std::copy(prefix.begin(), prefix.end(), m_counters.begin());
+    m_counters[depth] = begin;
+    m_current_loop = depth;
+    m_finished = begin >= end;
+  }
+
+  int operator()() const
+  {
+    if (m_current_loop == m_depth && m_counters[m_depth] >= m_end)
+      return std::numeric_limits<int>::max();
+    return m_counters[m_current_loop];
+  }
+
+  int end_of_loop()
+  {
+    int const breaks = m_breaks;
+    int const loop = m_current_loop;
+    int next_loop = BasicMultiLoop::end_of_loop();
+    if (m_finished || m_current_loop < m_depth)
+    {
+      // The loop at m_depth ended; either by its condition (or end), or because the body broke out of it.
+      m_broke_out = breaks > 0 && loop - breaks < m_depth;
+      m_finished = true;
+      return -1;
+    }
+    return next_loop;
+  }
+
+  bool broke_out() const { return m_broke_out; }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+
+// The four nested loops of multiloop_test.cxx, shared by the MultiLoop tests.
+//
+// The loops are written once as nested for loops (the reference) and once as the
+// body of a MultiLoop; both report what they do to a visitor:
+//
+//   visitor.counter(c)     - in the body of every loop, with its counter.
+//   visitor.inner_end()    - at the end of the body of the inner loop.
+//   visitor.loop_end(n)    - after loop n+1 ended; loop n continues.
+//
+// The MultiLoop body additionally calls visitor.top(ml), if that exists, at the very
+// top of every iteration of any loop (before the body can break out of it).
+
+// Writes the output of multiloop_test.cxx (the digest).
+struct DigestVisitor
+{
+  std::string& m_out;
+
+  void counter(int c) { m_out += std::to_string(c) + ','; }
+  void inner_end() { m_out += "E3,"; }
+  void loop_end(int loop) { m_out += "e" + std::to_string(loop) + ","; }
+};
+
+// Only sums the counters, to measure the loop overhead.
+struct ChecksumVisitor
+{
+  long m_sum = 0;
+
+  void counter(int c) { m_sum += c; }
+  void inner_end() { m_sum += 1000; }
+  void loop_end(int loop) { m_sum += 100 * loop; }
+};
+
+// Loop 1 and the loops inside it, for a given value of the counter of loop 0, with nested for loops.
+template<typename VISITOR>
+void multiloop_for_loops_inside(VISITOR& visitor, int i0)
+{
+  for (int i1 = i0; i1 < 12; ++i1)
+  {
+    if (i1 % 5 == 0)
+      break;
+    visitor.counter(i1);
+    for (int i2 = i1; i2 < 10; ++i2)
+    {
+      if (i2 == 7)
+      {
+        i1 = 100;       // break out of two loops.
+        break;
+      }
+      visitor.counter(i2);
+      for (int i3 = i2; i3 < 8; ++i3)
+      {
+        if (i3 % 3 == 1)
+          continue;
+        visitor.counter(i3);
+        if (i3 % 5 == 1)
+          continue;
+        if (i3 % 7 == 1)
+          break;
+        visitor.inner_end();
+      }
+      visitor.loop_end(2);
+    }
+    if (i1 != 100)
+      visitor.loop_end(1);
+  }
+}
+
+// All four loops, with nested for loops.
+template<typename VISITOR>
+void multiloop_for_loops(VISITOR& visitor)
+{
+  for (int i0 = 0; i0 < 14; ++i0)
+  {
+    visitor.counter(i0);
+    multiloop_for_loops_inside(visitor, i0);
+    visitor.loop_end(0);
+  }
+}
+
+// The expected output of multiloop_test.cxx.
+inline std::string multiloop_digest()
+{
+  std::string digest;
+  DigestVisitor visitor{digest};
+  multiloop_for_loops(visitor);
+  return digest;
+}
+
+// The same loops, for any MultiLoop type; the state of ml is the start state.
+template<typename ML, typename VISITOR>
+void multiloop_body(ML& ml, VISITOR& visitor)
+{
+  for (; !ml.finished(); ml.next_loop())        // Have 4 for loops inside eachother.
+  {
+    // *ml : loop number, in the range [0, 4].
+    // ml(): value of the current loop counter.
+    while (ml() < 14 - 2 * (int)*ml)
+    {
+      if constexpr (requires { visitor.top(ml); })
+        visitor.top(ml);
+      if (*ml == 1 && ml() % 5 == 0)
+      {
+        ml.breaks(1);
+        break;
+      }
+      if (*ml == 2 && ml() == 7)
+      {
+        ml.breaks(2);
+        break;
+      }
+      if (!ml.inner_loop())
+        visitor.counter(ml());
+      else
+      {
+        // Inner loop starts here.
+        if (ml() % 3 == 1)
+        {
+          ml.breaks(0);
+          break;
+        }
+        visitor.counter(ml());
+        if (ml() % 5 == 1)
+        {
+          ml.breaks(0);
+          break;
+        }
+        if (ml() % 7 == 1)
+        {
+          ml.breaks(1);
+          break;
+        }
+        // And ends here.
+        visitor.inner_end();
+      }
+      // Mandatory line. The value passed is the starting value of the next loop
+      // unless this is the inner loop, in which case the value is ignored.
+      ml.start_next_loop_at(ml());
+    }
+    int loop = ml.end_of_loop();
+    if (loop >= 0)
+    {
+      // Other loops end here.
+      visitor.loop_end(loop);
+    }
+  }
+}
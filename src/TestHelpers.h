@@ -0,0 +1,51 @@
+#pragma once
+
+#include <random>
+#include <string>
+#include <string_view>
+
+// Helpers shared by the benchmark tests.
+
+// Printable text without the characters in `excluded`, with the given fraction of random bytes.
+inline std::string random_input(size_t size, double binary_fraction, std::mt19937& gen, std::string_view excluded)
+{
+  std::uniform_int_distribution<> printable(0x20, 0x7e);
+  std::uniform_int_distribution<> any_byte(0, 255);
+  std::bernoulli_distribution binary(binary_fraction);
+  std::string s(size, ' ');
+  for (char& c : s)
+  {
+    if (binary(gen))
+      c = any_byte(gen);
+    else
+      do { c = printable(gen); } while (excluded.find(c) != std::string_view::npos);
+  }
+  return s;
+}
+
+#ifdef TEST_HELPERS_COUNT_ALLOCATIONS
+// Count the heap allocations. Replacing operator new is global to the program, hence opt-in:
+// define TEST_HELPERS_COUNT_ALLOCATIONS before including this header, in one translation unit.
+#include <cstdlib>
+#include <new>
+
+size_t number_of_allocations;
+
+void* operator new(size_t size)
+{
+  ++number_of_allocations;
+  if (void* ptr = std::malloc(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+#endif // TEST_HELPERS_COUNT_ALLOCATIONS
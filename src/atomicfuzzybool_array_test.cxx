@@ -0,0 +1,304 @@
+#include "sys.h"
+#include "debug.h"
+#include "utils/AtomicFuzzyBool.h"
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using utils::FuzzyBool;
+using utils::AtomicFuzzyBool;
+
+// An array of atomic fuzzy booleans, packed 32 per 64-bit atomic word.
+//
+// Each element uses two bits: False = 0, WasFalse = 1, WasTrue = 2 and True = 3.
+// With that encoding NOT is XOR with 3, AND is the minimum and OR the maximum,
+// which can be calculated for all 32 lanes of a word at once with a few bit
+// operations. Per element operations are a CAS loop on the containing word
+// (fetch_invert is a single fetch_xor); bulk operations work on whole words.
+class AtomicFuzzyBoolArray
+{
+ public:
+  using word_type = uint64_t;
+  static constexpr int lanes_per_word = 32;
+
+ private:
+  static constexpr word_type lo_bits = 0x5555555555555555UL;    // The low bit of every lane.
+  static constexpr word_type all_true = ~word_type{0};          // Every lane True.
+
+  size_t m_size;
+  std::unique_ptr<std::atomic<word_type>[]> m_words;
+
+  static word_type encode(FuzzyBool fb)
+  {
+    return fb.is_true() ? 3 : fb.is_transitory_true() ? 2 : fb.is_transitory_false() ? 1 : 0;
+  }
+
+  static FuzzyBool decode(word_type lane)
+  {
+    switch (lane)
+    {
+      case 0:
+        return fuzzy::False;
+      case 1:
+        return fuzzy::WasFalse;
+      case 2:
+        return fuzzy::WasTrue;
+    }
+    return fuzzy::True;
+  }
+
+  static int shift(size_t index) { return 2 * (index % lanes_per_word); }
+
+  static word_type broadcast(FuzzyBool fb) { return encode(fb) * lo_bits; }
+
+ public:
+  // Lane wise operations on packed words.
+  static word_type NOT(word_type a) { return ~a; }
+
+  static word_type AND(word_type a, word_type b)
+  {
+    word_type a1 = (a >> 1) & lo_bits, a0 = a & lo_bits;
+    word_type b1 = (b >> 1) & lo_bits, b0 = b & lo_bits;
+    word_type hi = a1 & b1;
+    // If the high bits are equal, the low bit is a0 & b0; otherwise it is the low bit of the lane with the high bit cleared.
+    word_type lo = (a0 & b0) | (a0 & ~a1 & b1) | (b0 & ~b1 & a1);
+    return (hi << 1) | lo;
+  }
+
+  static word_type OR(word_type a, word_type b) { return NOT(AND(NOT(a), NOT(b))); }
+  static word_type XOR(word_type a, word_type b) { return OR(AND(a, NOT(b)), AND(NOT(a), b)); }
+  static word_type NOT_XOR(word_type a, word_type b) { return NOT(XOR(a, b)); }
+
+ private:
+  // Atomically replace word w by op(w, operand).
+  template<typename OP>
+  word_type fetch_op(std::atomic<word_type>& word, word_type operand, OP op)
+  {
+    word_type old = word.load(std::memory_order_relaxed);
+    while (!word.compare_exchange_weak(old, op(old, operand), std::memory_order_acq_rel, std::memory_order_relaxed))
+      ;
+    return old;
+  }
+
+  // Apply op to element index only: all other lanes of the operand are the identity element of op.
+  template<typename OP>
+  FuzzyBool fetch_element(size_t index, FuzzyBool fb, word_type identity, OP op)
+  {
+    word_type mask = word_type{3} << shift(index);
+    word_type operand = (identity & ~mask) | (encode(fb) << shift(index));
+    word_type old = fetch_op(m_words[index / lanes_per_word], operand, op);
+    return decode((old >> shift(index)) & 3);
+  }
+
+ public:
+  AtomicFuzzyBoolArray(size_t size, FuzzyBool initial = fuzzy::False) :
+    m_size(size), m_words(new std::atomic<word_type>[number_of_words()])
+  {
+    for (size_t w = 0; w < number_of_words(); ++w)
+      m_words[w].store(broadcast(initial), std::memory_order_relaxed);
+  }
+
+  size_t size() const { return m_size; }
+  size_t number_of_words() const { return (m_size + lanes_per_word - 1) / lanes_per_word; }
+
+  FuzzyBool load(size_t index, std::memory_order order = std::memory_order_seq_cst) const
+  {
+    return decode((m_words[index / lanes_per_word].load(order) >> shift(index)) & 3);
+  }
+
+  void store(size_t index, FuzzyBool fb)
+  {
+    word_type mask = word_type{3} << shift(index);
+    fetch_op(m_words[index / lanes_per_word], encode(fb) << shift(index),
+        [mask](word_type w, word_type value){ return (w & ~mask) | value; });
+  }
+
+  // Per element read-modify-write operations; return the old value.
+  FuzzyBool fetch_AND(size_t index, FuzzyBool fb) { return fetch_element(index, fb, all_true, AND); }
+  FuzzyBool fetch_OR(size_t index, FuzzyBool fb) { return fetch_element(index, fb, 0, OR); }
+  FuzzyBool fetch_XOR(size_t index, FuzzyBool fb) { return fetch_element(index, fb, 0, XOR); }
+  FuzzyBool fetch_NOT_XOR(size_t index, FuzzyBool fb) { return fetch_element(index, fb, all_true, NOT_XOR); }
+
+  FuzzyBool fetch_invert(size_t index)
+  {
+    word_type old = m_words[index / lanes_per_word].fetch_xor(word_type{3} << shift(index), std::memory_order_acq_rel);
+    return decode((old >> shift(index)) & 3);
+  }
+
+  // Word wide operations: apply the operation to all 32 elements of word w at once; return the old word.
+  word_type fetch_AND_word(size_t w, word_type operand) { return fetch_op(m_words[w], operand, AND); }
+  word_type fetch_OR_word(size_t w, word_type operand) { return fetch_op(m_words[w], operand, OR); }
+  word_type fetch_invert_word(size_t w) { return m_words[w].fetch_xor(all_true, std::memory_order_acq_rel); }
+
+  // Set all elements to fb.
+  void fill(FuzzyBool fb)
+  {
+    for (size_t w = 0; w < number_of_words(); ++w)
+      m_words[w].store(broadcast(fb), std::memory_order_relaxed);
+  }
+
+  // Call f(index) for every element that is True (lane == 3), respectively WasTrue (lane == 2).
+  // Each word is tested for 32 lanes at once; only the matching lanes are visited.
+  template<typename F>
+  void for_each_true(F f) const { scan(f, [](word_type w){ return w & (w >> 1) & lo_bits; }); }
+
+  template<typename F>
+  void for_each_was_true(F f) const { scan(f, [](word_type w){ return (w >> 1) & ~w & lo_bits; }); }
+
+  size_t count_true() const
+  {
+    size_t count = 0;
+    for (size_t w = 0; w < number_of_words(); ++w)
+    {
+      word_type word = m_words[w].load(std::memory_order_relaxed);
+      count += std::popcount(word & (word >> 1) & lo_bits);
+    }
+    return count;
+  }
+
+ private:
+  template<typename F, typename MATCH>
+  void scan(F& f, MATCH match) const
+  {
+    for (size_t w = 0; w < number_of_words(); ++w)
+    {
+      word_type matches = match(m_words[w].load(std::memory_order_relaxed));
+      while (matches)
+      {
+        size_t index = w * lanes_per_word + std::countr_zero(matches) / 2;
+        if (index >= m_size)
+          break;
+        f(index);
+        matches &= matches - 1;
+      }
+    }
+  }
+};
+
+FuzzyBool get_fuzzy_bool(int val)
+{
+  switch (val)
+  {
+    case 0:
+      return fuzzy::False;
+    case 1:
+      return fuzzy::WasFalse;
+    case 2:
+      return fuzzy::WasTrue;
+  }
+  return fuzzy::True;
+}
+
+bool equal(FuzzyBool fb1, FuzzyBool fb2)
+{
+  return (fb1.is_true() && fb2.is_true()) ||
+         (fb1.is_transitory_true() && fb2.is_transitory_true()) ||
+         (fb1.is_transitory_false() && fb2.is_transitory_false()) ||
+         (fb1.is_false() && fb2.is_false());
+}
+
+// Print the table of op applied to element 17 of an array (the other lanes must be left alone).
+// The row is the initial value of the element, the column the operand.
+void print_table(std::function<FuzzyBool(AtomicFuzzyBoolArray&, size_t, FuzzyBool const&)> op)
+{
+  std::cout << std::setw(15) << ' ' << ' ';
+  for (int v1 = 0; v1 < 4; ++v1)
+    std::cout << " |" << std::setw(15) << get_fuzzy_bool(v1);
+  std::cout << "\n-----------------------------------------------------------\n";
+  for (int v0 = 0; v0 < 4; ++v0)
+  {
+    FuzzyBool fb0 = get_fuzzy_bool(v0);
+    std::cout << std::setw(15) << fb0 << ' ';
+    for (int v1 = 0; v1 < 4; ++v1)
+    {
+      AtomicFuzzyBoolArray array(64, fuzzy::WasTrue);
+      array.store(17, fb0);
+      FuzzyBool old = op(array, 17, get_fuzzy_bool(v1));
+      ASSERT(equal(old, fb0));
+      for (size_t i = 0; i < array.size(); ++i)
+        ASSERT(i == 17 || equal(array.load(i), fuzzy::WasTrue));
+      std::cout << " |" << std::setw(15) << array.load(17);
+    }
+    std::cout << '\n';
+  }
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The packed operations must agree with FuzzyBool (and thus AtomicFuzzyBool) for every combination.
+  for (int v0 = 0; v0 < 4; ++v0)
+    for (int v1 = 0; v1 < 4; ++v1)
+    {
+      FuzzyBool fb0 = get_fuzzy_bool(v0);
+      FuzzyBool fb1 = get_fuzzy_bool(v1);
+      AtomicFuzzyBoolArray array(1);
+      array.store(0, fb0); array.fetch_AND(0, fb1); ASSERT(equal(array.load(0), fb0 && fb1));
+      array.store(0, fb0); array.fetch_OR(0, fb1); ASSERT(equal(array.load(0), fb0 || fb1));
+      array.store(0, fb0); array.fetch_XOR(0, fb1); ASSERT(equal(array.load(0), fb0 != fb1));
+      array.store(0, fb0); array.fetch_NOT_XOR(0, fb1); ASSERT(equal(array.load(0), fb0 == fb1));
+      array.store(0, fb1); array.fetch_invert(0); ASSERT(equal(array.load(0), !fb1));
+      AtomicFuzzyBool afb = fb0;
+      afb.fetch_XOR(fb1);
+      ASSERT(equal(afb.load(), fb0 != fb1));
+    }
+
+  std::cout << "\nLogical NOT:\n";
+  print_table([](AtomicFuzzyBoolArray& a, size_t i, FuzzyBool const&){ return a.fetch_invert(i); });
+  std::cout << "\nLogical AND:\n";
+  print_table([](AtomicFuzzyBoolArray& a, size_t i, FuzzyBool const& fb){ return a.fetch_AND(i, fb); });
+  std::cout << "\nLogical OR:\n";
+  print_table([](AtomicFuzzyBoolArray& a, size_t i, FuzzyBool const& fb){ return a.fetch_OR(i, fb); });
+  std::cout << "\nLogical XOR:\n";
+  print_table([](AtomicFuzzyBoolArray& a, size_t i, FuzzyBool const& fb){ return a.fetch_XOR(i, fb); });
+  std::cout << "\nLogical NOT XOR:\n";
+  print_table([](AtomicFuzzyBoolArray& a, size_t i, FuzzyBool const& fb){ return a.fetch_NOT_XOR(i, fb); });
+
+  // Scans.
+  constexpr size_t size = 10000000;
+  AtomicFuzzyBoolArray array(size);
+  std::vector<AtomicFuzzyBool> unpacked(size);
+  for (size_t i = 0; i < size; i += 97)
+  {
+    array.store(i, fuzzy::True);
+    unpacked[i] = fuzzy::True;
+  }
+  for (size_t i = 13; i < size; i += 1013)
+  {
+    array.store(i, fuzzy::WasTrue);
+    unpacked[i] = fuzzy::WasTrue;
+  }
+  std::cout << "\nMemory: " << size * sizeof(AtomicFuzzyBool) << " bytes unpacked, " <<
+    array.number_of_words() * sizeof(AtomicFuzzyBoolArray::word_type) << " bytes packed." << std::endl;
+
+  size_t found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < size; ++i)
+    if (unpacked[i].is_true())
+      ++found;
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "Scanning std::vector<AtomicFuzzyBool> for True: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us." << std::endl;
+
+  size_t packed_found = 0;
+  start = std::chrono::steady_clock::now();
+  array.for_each_true([&](size_t){ ++packed_found; });
+  end = std::chrono::steady_clock::now();
+  std::cout << "Scanning AtomicFuzzyBoolArray for True: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us." << std::endl;
+  ASSERT(found == packed_found && found == array.count_true());
+
+  size_t was_true = 0;
+  array.for_each_was_true([&](size_t index){ ASSERT(unpacked[index].load().is_transitory_true()); ++was_true; });
+  for (size_t i = 0; i < size; ++i)
+    if (unpacked[i].load().is_transitory_true())
+      --was_true;
+  ASSERT(was_true == 0);
+
+  Dout(dc::notice, "Success");
+}
@@ -0,0 +1,216 @@
+#include "sys.h"
+#include "debug.h"
+#include "utils/AtomicFuzzyBool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using utils::FuzzyBool;
+
+// An atomic FuzzyBool that threads can block on until it becomes True or False.
+//
+// The value is stored in a 32-bit futex word (False = 0, WasFalse = 1,
+// WasTrue = 2, True = 3). Every modification (assignment and the fetch_*
+// functions) wakes up the waiters, but only makes the FUTEX_WAKE syscall
+// when m_waiters is non-zero. Both the modification and the check of
+// m_waiters (and vice versa for the waiter) are sequentially consistent,
+// so either the notifier sees the waiter, or the waiter sees the new value.
+class WaitableAtomicFuzzyBool
+{
+ private:
+  std::atomic<uint32_t> m_value;
+  std::atomic<uint32_t> m_waiters{0};
+
+  static uint32_t encode(FuzzyBool fb)
+  {
+    return fb.is_true() ? 3 : fb.is_transitory_true() ? 2 : fb.is_transitory_false() ? 1 : 0;
+  }
+
+  static FuzzyBool decode(uint32_t value)
+  {
+    switch (value)
+    {
+      case 0:
+        return fuzzy::False;
+      case 1:
+        return fuzzy::WasFalse;
+      case 2:
+        return fuzzy::WasTrue;
+    }
+    return fuzzy::True;
+  }
+
+  void notify()
+  {
+    if (m_waiters.load(std::memory_order_seq_cst) > 0)
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+  template<typename OP>
+  FuzzyBool fetch_op(OP op)
+  {
+    uint32_t old = m_value.load(std::memory_order_relaxed);
+    uint32_t value;
+    do
+    {
+      value = encode(op(decode(old)));
+    }
+    while (!m_value.compare_exchange_weak(old, value, std::memory_order_seq_cst, std::memory_order_relaxed));
+    if (value != old)
+      notify();
+    return decode(old);
+  }
+
+  // Block until the value is `target` or the timeout expired. Returns false in the latter case.
+  bool wait_until(uint32_t target, std::chrono::steady_clock::duration const* timeout)
+  {
+    if (m_value.load(std::memory_order_acquire) == target)
+      return true;
+    auto const deadline = timeout ? std::chrono::steady_clock::now() + *timeout : std::chrono::steady_clock::time_point{};
+    m_waiters.fetch_add(1, std::memory_order_seq_cst);
+    bool success = true;
+    for (uint32_t value; (value = m_value.load(std::memory_order_seq_cst)) != target;)
+    {
+      timespec ts;
+      if (timeout)
+      {
+        auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= remaining.zero())
+        {
+          success = false;
+          break;
+        }
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(remaining);
+        ts.tv_sec = seconds.count();
+        ts.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining - seconds).count();
+      }
+      // Returns immediately if m_value is no longer equal to value.
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value), FUTEX_WAIT_PRIVATE, value, timeout ? &ts : nullptr, nullptr, 0);
+    }
+    m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    return success;
+  }
+
+ public:
+  WaitableAtomicFuzzyBool(FuzzyBool fb = fuzzy::False) : m_value(encode(fb)) { }
+
+  WaitableAtomicFuzzyBool& operator=(FuzzyBool fb)
+  {
+    uint32_t value = encode(fb);
+    if (m_value.exchange(value, std::memory_order_seq_cst) != value)
+      notify();
+    return *this;
+  }
+
+  FuzzyBool load() const { return decode(m_value.load(std::memory_order_acquire)); }
+  bool is_true() const { return m_value.load(std::memory_order_acquire) == 3; }
+  bool is_false() const { return m_value.load(std::memory_order_acquire) == 0; }
+
+  FuzzyBool fetch_AND(FuzzyBool fb) { return fetch_op([fb](FuzzyBool old){ return old && fb; }); }
+  FuzzyBool fetch_OR(FuzzyBool fb) { return fetch_op([fb](FuzzyBool old){ return old || fb; }); }
+  FuzzyBool fetch_XOR(FuzzyBool fb) { return fetch_op([fb](FuzzyBool old){ return old != fb; }); }
+  FuzzyBool fetch_NOT_XOR(FuzzyBool fb) { return fetch_op([fb](FuzzyBool old){ return old == fb; }); }
+  FuzzyBool fetch_invert() { return fetch_op([](FuzzyBool old){ return !old; }); }
+
+  void wait_until_true() { wait_until(3, nullptr); }
+  void wait_until_false() { wait_until(0, nullptr); }
+  bool wait_until_true(std::chrono::steady_clock::duration timeout) { return wait_until(3, &timeout); }
+  bool wait_until_false(std::chrono::steady_clock::duration timeout) { return wait_until(0, &timeout); }
+
+  // Number of threads that are currently blocked (or about to block).
+  uint32_t waiters() const { return m_waiters.load(std::memory_order_relaxed); }
+};
+
+// Start number_of_waiters threads that wait until flag is True, then set it and
+// return the wake-up latency of every waiter in nanoseconds (sorted).
+template<typename WAIT>
+std::vector<long> one_to_many(int number_of_waiters, WaitableAtomicFuzzyBool& flag, WAIT wait)
+{
+  using clock = std::chrono::steady_clock;
+  flag = fuzzy::False;
+  std::atomic<int> started{0};
+  std::vector<clock::time_point> woken(number_of_waiters);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < number_of_waiters; ++t)
+    threads.emplace_back([&, t](){
+      ++started;
+      wait(flag);
+      woken[t] = clock::now();
+    });
+  while (started < number_of_waiters)
+    std::this_thread::yield();
+  // Give the waiters time to block.
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  auto start = clock::now();
+  flag = fuzzy::True;
+  for (std::thread& thread : threads)
+    thread.join();
+  std::vector<long> latencies;
+  for (auto& time : woken)
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(time - start).count());
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+template<typename WAIT>
+void benchmark(char const* name, WAIT wait)
+{
+  WaitableAtomicFuzzyBool flag;
+  for (int number_of_waiters : { 1, 4, 16 })
+  {
+    std::vector<long> first, last;
+    for (int round = 0; round < 100; ++round)
+    {
+      std::vector<long> latencies = one_to_many(number_of_waiters, flag, wait);
+      first.push_back(latencies.front());
+      last.push_back(latencies.back());
+    }
+    std::sort(first.begin(), first.end());
+    std::sort(last.begin(), last.end());
+    std::cout << name << " with " << number_of_waiters << " waiters: median latency of the first waiter " << first[first.size() / 2] <<
+      " ns, of the last waiter " << last[last.size() / 2] << " ns." << std::endl;
+  }
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  WaitableAtomicFuzzyBool flag;
+
+  // Timeouts.
+  auto start = std::chrono::steady_clock::now();
+  ASSERT(!flag.wait_until_true(std::chrono::milliseconds(20)));
+  ASSERT(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+  ASSERT(flag.wait_until_false(std::chrono::milliseconds(20)));
+  ASSERT(flag.waiters() == 0);
+
+  // Wake-up through the fetch_* functions: False -> WasTrue -> True.
+  std::thread waiter([&](){ flag.wait_until_true(); });
+  flag.fetch_XOR(fuzzy::WasTrue);
+  ASSERT(flag.load().is_transitory_true());
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  flag.fetch_OR(fuzzy::True);
+  waiter.join();
+  ASSERT(flag.is_true());
+
+  // And back to False.
+  std::thread waiter2([&](){ flag.wait_until_false(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  flag.fetch_invert();
+  waiter2.join();
+  ASSERT(flag.is_false());
+
+  benchmark("wait_until_true()", [](WaitableAtomicFuzzyBool& flag){ flag.wait_until_true(); });
+  benchmark("polling is_true()", [](WaitableAtomicFuzzyBool& flag){ while (!flag.is_true()) std::this_thread::yield(); });
+
+  Dout(dc::notice, "Success");
+}
@@ -0,0 +1,374 @@
+#include "sys.h"
+#include "utils/AIRefCount.h"
+#include "utils/FuzzyBool.h"
+#include "debug.h"
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Biased reference counting.
+//
+// The thread that creates an object (the owner) updates a non-atomic counter
+// (m_biased); all other threads use the atomic m_shared. The lower two bits of
+// m_shared are flags, the count is stored in the remaining bits.
+//
+// When the owner drops its last biased reference it merges: it sets the merged
+// flag, after which the object is an ordinary atomically counted object.
+// A reference that was taken by the owner can be released by another thread;
+// that makes the shared count negative. The first time that happens the object
+// is queued to the owner, which merges it the next time it calls
+// merge_queued() (call that at quiescent points), or when it exits.
+// Deletion happens exactly once: by the thread that brings the merged count to
+// zero, unless the object is queued, in which case the owner deletes it while
+// processing its queue.
+//
+// The ThreadTag of the owner is allocated on the heap and reference counted by
+// the thread and by the objects that it owns, so that it outlives the thread
+// when necessary and its address is never reused while an object refers to it.
+// When the owner exited, a thread that would queue an object to it merges the
+// object itself. From then on the exiting thread is no longer the owner of
+// anything: its releases (for example by the destructors of other thread_local
+// objects) go through m_shared, and objects that it creates after that start
+// merged, without an owner.
+class BiasedRefCount
+{
+ private:
+  static constexpr int64_t merged = 1;
+  static constexpr int64_t queued = 2;
+  static constexpr int64_t one = 4;
+
+  struct ThreadTag
+  {
+    std::atomic<int> m_references{1};           // The thread, plus every object that it owns.
+    std::mutex m_mutex;
+    std::vector<BiasedRefCount*> m_queue;
+    bool m_exited = false;                      // Protected by m_mutex.
+
+    void release()
+    {
+      if (m_references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+    }
+  };
+
+  // Merges the queued objects of the thread, and releases its ThreadTag, when the thread exits.
+  struct ThreadTagHolder
+  {
+    ThreadTag* m_tag = new ThreadTag;
+    ~ThreadTagHolder();
+  };
+  static thread_local ThreadTagHolder t_tag;
+  // Set when t_tag was destroyed. Being trivially destructible, it can still be read after that.
+  static thread_local bool t_exited;
+
+  ThreadTag* const m_owner;                     // nullptr if the object was created after its thread exited.
+  int m_biased;                                 // Only accessed by the owner (or after the owner exited).
+  std::atomic<int64_t> m_shared;
+
+  static int64_t count(int64_t shared) { return shared >> 2; }
+
+  bool is_owner() const { return !t_exited && m_owner == t_tag.m_tag && !(m_shared.load(std::memory_order_relaxed) & merged); }
+
+  // Called by the owner when m_biased dropped to zero; all remaining references are counted in m_shared.
+  void merge_biased()
+  {
+    int64_t shared = m_shared.fetch_add(merged, std::memory_order_acq_rel) + merged;
+    if (count(shared) == 0 && !(shared & queued))
+      delete this;
+  }
+
+  // Called for a queued object, by the owner or, after the owner exited, by the thread that queued it.
+  void merge_queued_object(bool owner_exited)
+  {
+    if (owner_exited || is_owner())
+    {
+      m_shared.fetch_add(m_biased * one, std::memory_order_acq_rel);
+      m_biased = 0;
+      m_shared.fetch_or(merged, std::memory_order_acq_rel);
+    }
+    // From now on non-owners that bring the count to zero delete the object.
+    int64_t shared = m_shared.fetch_and(~queued, std::memory_order_acq_rel);
+    if (count(shared) == 0)
+      delete this;
+  }
+
+ protected:
+  BiasedRefCount() : m_owner(t_exited ? nullptr : t_tag.m_tag), m_biased(0), m_shared(t_exited ? merged : 0)
+  {
+    if (m_owner)
+      m_owner->m_references.fetch_add(1, std::memory_order_relaxed);
+  }
+  BiasedRefCount(BiasedRefCount const&) : BiasedRefCount() { }
+  virtual ~BiasedRefCount()
+  {
+    if (m_owner)
+      m_owner->release();
+  }
+
+ public:
+  void add_ref()
+  {
+    if (is_owner())
+      ++m_biased;
+    else
+      m_shared.fetch_add(one, std::memory_order_relaxed);
+  }
+
+  void release()
+  {
+    if (is_owner())
+    {
+      if (--m_biased == 0)
+        merge_biased();
+      return;
+    }
+    // Decrement, and set the queued flag in the same atomic operation when the count goes negative the first time.
+    int64_t shared = m_shared.load(std::memory_order_relaxed);
+    int64_t new_shared;
+    do
+    {
+      new_shared = shared - one;
+      if (!(new_shared & merged) && count(new_shared) < 0)
+        new_shared |= queued;
+    }
+    while (!m_shared.compare_exchange_weak(shared, new_shared, std::memory_order_acq_rel, std::memory_order_relaxed));
+    if (new_shared & merged)
+    {
+      if (count(new_shared) == 0 && !(new_shared & queued))
+        delete this;
+    }
+    else if ((new_shared & queued) && !(shared & queued))
+    {
+      // The count went negative: the owner holds biased references that were released by us. Let the owner merge.
+      {
+        std::lock_guard<std::mutex> lock(m_owner->m_mutex);
+        if (!m_owner->m_exited)
+        {
+          m_owner->m_queue.push_back(this);
+          return;
+        }
+      }
+      // The owner is gone; its m_biased can't change anymore.
+      merge_queued_object(true);
+    }
+  }
+
+  // Merge (and possibly delete) all objects that other threads queued to the current thread.
+  static void merge_queued()
+  {
+    if (t_exited)
+      return;
+    std::vector<BiasedRefCount*> queue;
+    {
+      std::lock_guard<std::mutex> lock(t_tag.m_tag->m_mutex);
+      queue.swap(t_tag.m_tag->m_queue);
+    }
+    for (BiasedRefCount* object : queue)
+      object->merge_queued_object(false);
+  }
+
+  // True if we hold the only reference. Non-owners of an object that wasn't merged yet
+  // can't see the biased count; they get WasFalse.
+  utils::FuzzyBool unique() const
+  {
+    int64_t shared = m_shared.load(std::memory_order_acquire);
+    if (is_owner())
+      return m_biased + count(shared) == 1 ? fuzzy::True : fuzzy::WasFalse;
+    if (!(shared & merged))
+      return fuzzy::WasFalse;
+    return count(shared) == 1 ? fuzzy::True : fuzzy::WasFalse;
+  }
+
+  // Increment the reference count and return its old value (exact for the owner, or after merging).
+  int inhibit_deletion()
+  {
+    int result = count(m_shared.load(std::memory_order_acquire)) + (is_owner() ? m_biased : 0);
+    add_ref();
+    return result;
+  }
+
+  void allow_deletion() { release(); }
+
+  friend void intrusive_ptr_add_ref(BiasedRefCount* p) { p->add_ref(); }
+  friend void intrusive_ptr_release(BiasedRefCount* p) { p->release(); }
+};
+
+//static
+thread_local BiasedRefCount::ThreadTagHolder BiasedRefCount::t_tag;
+//static
+thread_local bool BiasedRefCount::t_exited;
+
+BiasedRefCount::ThreadTagHolder::~ThreadTagHolder()
+{
+  // Merge the queue until it is empty; objects can be queued while we do that.
+  for (;;)
+  {
+    std::vector<BiasedRefCount*> queue;
+    {
+      std::lock_guard<std::mutex> lock(m_tag->m_mutex);
+      if (m_tag->m_queue.empty())
+      {
+        // From now on, threads that queue an object to us merge it themselves, reading m_biased
+        // of that object; this thread doesn't change m_biased anymore after unlocking the mutex.
+        m_tag->m_exited = true;
+        t_exited = true;
+        break;
+      }
+      queue.swap(m_tag->m_queue);
+    }
+    for (BiasedRefCount* object : queue)
+      object->merge_queued_object(false);
+  }
+  m_tag->release();
+}
+
+std::atomic<int> destructed{0};
+
+struct Test : public BiasedRefCount {
+  int m_magic;
+  Test() : m_magic(0x12345678) { }
+  ~Test() { m_magic = 0; ++destructed; }
+  char const* test() const { return m_magic == 0x12345678 ? "OK!" : "DELETED!"; }
+  int ref_count()
+  {
+    int result = inhibit_deletion();
+    allow_deletion();
+    return result;
+  }
+};
+
+struct Atomic : public AIRefCount {
+};
+
+struct Biased : public BiasedRefCount {
+};
+
+// Every thread copies and destroys intrusive_ptr's to its own object.
+template<typename T>
+double copy_destroy(int number_of_threads)
+{
+  constexpr int iterations = 10000000;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < number_of_threads; ++t)
+    threads.emplace_back([](){
+      boost::intrusive_ptr<T> p = new T;
+      for (int i = 0; i < iterations; ++i)
+      {
+        boost::intrusive_ptr<T> copy(p);
+        asm volatile ("" :: "r" (copy.get()));
+      }
+    });
+  for (std::thread& thread : threads)
+    thread.join();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The same invariants as refcount_test.cxx, in the owning thread.
+  {
+    boost::intrusive_ptr<Test> p1 = new Test;
+    ASSERT(p1->unique().is_true() && p1->ref_count() == 1);
+    boost::intrusive_ptr<Test> p2 = p1;
+    {
+      boost::intrusive_ptr<Test> p3(p1);
+      ASSERT(p1->unique().is_momentary_false() && p3->ref_count() == 3);
+      p2.reset();
+      ASSERT(p1->unique().is_momentary_false() && p3->ref_count() == 2);
+    }
+    ASSERT(p1->unique().is_true() && p1->ref_count() == 1);
+  }
+  ASSERT(destructed == 1);
+
+  // Objects created here and released by other threads: hand-off without merging first.
+  {
+    constexpr int number_of_objects = 100000;
+    std::vector<boost::intrusive_ptr<Test>> objects;
+    for (int i = 0; i < number_of_objects; ++i)
+      objects.emplace_back(new Test);
+    std::vector<boost::intrusive_ptr<Test>> copies(objects);
+    std::thread t1([&](){ for (int i = 0; i < number_of_objects; i += 2) { ASSERT(*objects[i]->test() == 'O'); objects[i].reset(); } });
+    std::thread t2([&](){ for (int i = 1; i < number_of_objects; i += 2) { ASSERT(*copies[i]->test() == 'O'); copies[i].reset(); } });
+    t1.join();
+    t2.join();
+    // Drop the remaining references in the owner; objects whose count went negative are deleted by merge_queued().
+    for (int i = 0; i < number_of_objects; i += 2)
+      copies[i].reset();
+    ASSERT(destructed == 1);                    // All objects are still referenced, or queued.
+    for (int i = 1; i < number_of_objects; i += 2)
+      objects[i].reset();
+    BiasedRefCount::merge_queued();
+    ASSERT(destructed == 1 + number_of_objects);
+  }
+
+  // The owner exits while it still holds (biased) references that are released by another thread afterwards.
+  {
+    int const destructed_before = destructed;
+    boost::intrusive_ptr<Test> held;                    // A biased reference, taken by the owner.
+    boost::intrusive_ptr<Test> queued_object;           // Queued to the owner before it exits.
+    std::thread owner([&](){
+      held = new Test;
+      boost::intrusive_ptr<Test> p = new Test;
+      queued_object = p;
+      std::thread([&](){ queued_object.reset(); }).join();   // Goes negative: queued.
+      queued_object = p;
+      // Exit without calling merge_queued().
+    });
+    owner.join();
+    ASSERT(destructed == destructed_before);
+    ASSERT(*held->test() == 'O' && *queued_object->test() == 'O');
+    held.reset();                                       // Merged by this thread.
+    ASSERT(destructed == destructed_before + 1);
+    queued_object.reset();                              // Was merged when the owner exited.
+    ASSERT(destructed == destructed_before + 2);
+    // Objects owned by a new thread are not mistaken for objects of the old one.
+    std::thread([&](){
+      boost::intrusive_ptr<Test> p = new Test;
+      ASSERT(p->unique().is_true() && p->ref_count() == 1);
+    }).join();
+    ASSERT(destructed == destructed_before + 3);
+  }
+
+  // Releases and new objects in a thread, after its ThreadTagHolder was destroyed.
+  {
+    int const destructed_before = destructed;
+    boost::intrusive_ptr<Test> shared_object;
+    std::thread([&](){
+      // Constructed before t_tag (the first BiasedRefCount is created below), so destroyed after it.
+      struct Late
+      {
+        boost::intrusive_ptr<Test> m_held;
+        ~Late()
+        {
+          m_held.reset();                               // A biased reference of the former owner.
+          boost::intrusive_ptr<Test> p = new Test;      // Created without an owner.
+          ASSERT(p->unique().is_true() && p->ref_count() == 1);
+        }
+      };
+      static thread_local Late late;
+      late.m_held = new Test;
+      shared_object = late.m_held;
+    }).join();
+    ASSERT(destructed == destructed_before + 1);        // The object created in ~Late().
+    ASSERT(*shared_object->test() == 'O');
+    shared_object.reset();
+    ASSERT(destructed == destructed_before + 2);
+  }
+
+  for (int number_of_threads : { 1, 2, 4 })
+  {
+    std::cout << number_of_threads << " threads: AIRefCount " << copy_destroy<Atomic>(number_of_threads) << " ns, " <<
+      "BiasedRefCount " << copy_destroy<Biased>(number_of_threads) << " ns (wall clock) per iteration of every thread." << std::endl;
+  }
+
+  Dout(dc::notice, "Success");
+}
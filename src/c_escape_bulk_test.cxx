@@ -0,0 +1,367 @@
+#include "sys.h"
+#include "debug.h"
+#include "utils/c_escape_iterator.h"
+#include "TestHelpers.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Bulk escaping that produces exactly the same output as utils::c_escape_iterator.
+//
+// Which bytes c_escape_iterator copies unchanged ("clean" bytes) is determined
+// once, by feeding it every byte value. If the clean bytes form one range minus
+// at most max_exceptions bytes (printable ASCII minus the backslash and the
+// double quote), runs of clean bytes are found 16 (SSE2) or 32 (AVX2) bytes at
+// a time; otherwise with a table lookup per byte. Clean runs are appended with
+// a single append.
+//
+// The escape sequence of every other byte is looked up in a table that was
+// filled by c_escape_iterator as well, provided that it was verified that the
+// sequence doesn't depend on the next byte (as a hex escape followed by a hex
+// digit could). Otherwise runs of special bytes, plus one byte of context, are
+// escaped by c_escape_iterator itself.
+class CEscapeScanner
+{
+ public:
+  static constexpr int max_exceptions = 4;
+  static constexpr size_t max_escape_size = 8;
+
+ private:
+  using it_escaped_t = utils::c_escape_iterator<std::string_view::const_iterator>;
+
+  std::array<bool, 256> m_clean;
+  bool m_vectorizable = false;
+  unsigned char m_low;                          // The clean bytes are [m_low, m_high] minus the exceptions.
+  unsigned char m_high;
+  int m_number_of_exceptions = 0;
+  std::array<unsigned char, max_exceptions> m_exceptions;
+  bool m_context_free = true;                   // Set if m_escape can be used.
+  std::array<std::array<char, max_escape_size>, 256> m_escape{};
+  std::array<unsigned char, 256> m_escape_size{};
+
+  CEscapeScanner();
+
+  static std::string escape_with_iterator(std::string_view sv)
+  {
+    return std::string(it_escaped_t(sv.begin(), sv.end()), it_escaped_t(sv.end(), sv.end()));
+  }
+
+#ifdef __AVX2__
+  char const* skip_clean_avx2(char const* p, char const* end) const;
+#endif
+#ifdef __SSE2__
+  char const* skip_clean_sse2(char const* p, char const* end) const;
+#endif
+
+ public:
+  static CEscapeScanner const& instance()
+  {
+    static CEscapeScanner const s_instance;
+    return s_instance;
+  }
+
+  bool is_clean(char c) const { return m_clean[static_cast<unsigned char>(c)]; }
+
+  // Returns the length of the longest prefix of [begin, end) that consists of clean bytes.
+  size_t clean_prefix(char const* begin, char const* end) const;
+
+  // Escape the special bytes [begin, end) and append the result to out.
+  template<typename StagingBuffer>
+  void escape_special(char const* begin, char const* end, StagingBuffer& out) const
+  {
+    if (m_context_free)
+    {
+      for (char const* p = begin; p != end; ++p)
+      {
+        unsigned char const c = *p;
+        out.append_escape(m_escape[c].data(), m_escape_size[c]);
+      }
+      return;
+    }
+    std::string_view const sv(begin, end - begin);
+    for (it_escaped_t it(sv.begin(), sv.end()), it_end(sv.end(), sv.end()); it != it_end; ++it)
+      out.push_back(*it);
+  }
+
+  bool context_free() const { return m_context_free; }
+};
+
+CEscapeScanner::CEscapeScanner()
+{
+  for (int c = 0; c < 256; ++c)
+  {
+    char const ch = c;
+    std::string const escaped = escape_with_iterator({ &ch, 1 });
+    m_clean[c] = escaped.size() == 1 && escaped[0] == ch;
+    if (escaped.size() > max_escape_size)
+      m_context_free = false;
+    else
+    {
+      std::copy(escaped.begin(), escaped.end(), m_escape[c].begin());
+      m_escape_size[c] = escaped.size();
+    }
+  }
+  // Check that the escape sequence of every special byte is independent of the next byte.
+  for (int c1 = 0; c1 < 256 && m_context_free; ++c1)
+  {
+    if (m_clean[c1])
+      continue;
+    for (int c2 = 0; c2 < 256; ++c2)
+    {
+      char const pair[2] = { static_cast<char>(c1), static_cast<char>(c2) };
+      std::string const escaped = escape_with_iterator({ pair, 2 });
+      if (escaped.size() != m_escape_size[c1] + m_escape_size[c2] ||
+          escaped.compare(0, m_escape_size[c1], m_escape[c1].data(), m_escape_size[c1]) != 0)
+      {
+        m_context_free = false;
+        break;
+      }
+    }
+  }
+
+  int low = 256, high = -1;
+  for (int c = 0; c < 256; ++c)
+    if (m_clean[c])
+    {
+      low = std::min(low, c);
+      high = c;
+    }
+  if (high == -1)
+    return;
+  m_low = low;
+  m_high = high;
+  for (int c = low; c <= high; ++c)
+    if (!m_clean[c])
+    {
+      if (m_number_of_exceptions == max_exceptions)
+        return;
+      m_exceptions[m_number_of_exceptions++] = c;
+    }
+  m_vectorizable = true;
+}
+
+// Bytes are compared as signed values, so the sign bit of everything is flipped first.
+
+#ifdef __AVX2__
+char const* CEscapeScanner::skip_clean_avx2(char const* p, char const* const end) const
+{
+  __m256i const flip = _mm256_set1_epi8(static_cast<char>(0x80));
+  __m256i const low = _mm256_set1_epi8(static_cast<char>(m_low ^ 0x80));
+  __m256i const high = _mm256_set1_epi8(static_cast<char>(m_high ^ 0x80));
+  for (; end - p >= 32; p += 32)
+  {
+    __m256i const v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(p)), flip);
+    __m256i dirty = _mm256_or_si256(_mm256_cmpgt_epi8(low, v), _mm256_cmpgt_epi8(v, high));
+    for (int i = 0; i < m_number_of_exceptions; ++i)
+      dirty = _mm256_or_si256(dirty, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(static_cast<char>(m_exceptions[i] ^ 0x80))));
+    if (uint32_t mask = _mm256_movemask_epi8(dirty))
+      return p + std::countr_zero(mask);
+  }
+  return p;
+}
+#endif
+
+#ifdef __SSE2__
+char const* CEscapeScanner::skip_clean_sse2(char const* p, char const* const end) const
+{
+  __m128i const flip = _mm_set1_epi8(static_cast<char>(0x80));
+  __m128i const low = _mm_set1_epi8(static_cast<char>(m_low ^ 0x80));
+  __m128i const high = _mm_set1_epi8(static_cast<char>(m_high ^ 0x80));
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i const v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p)), flip);
+    __m128i dirty = _mm_or_si128(_mm_cmplt_epi8(v, low), _mm_cmpgt_epi8(v, high));
+    for (int i = 0; i < m_number_of_exceptions; ++i)
+      dirty = _mm_or_si128(dirty, _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(m_exceptions[i] ^ 0x80))));
+    if (uint32_t mask = _mm_movemask_epi8(dirty))
+      return p + std::countr_zero(mask);
+  }
+  return p;
+}
+#endif
+
+size_t CEscapeScanner::clean_prefix(char const* const begin, char const* const end) const
+{
+  char const* p = begin;
+  if (m_vectorizable)
+  {
+#ifdef __AVX2__
+    p = skip_clean_avx2(p, end);
+    if (end - p >= 32)
+      return p - begin;
+#endif
+#ifdef __SSE2__
+    p = skip_clean_sse2(p, end);
+    if (end - p >= 16)
+      return p - begin;
+#endif
+  }
+  while (p != end && is_clean(*p))
+    ++p;
+  return p - begin;
+}
+
+// Collects the many small pieces of output of c_escape and appends them to the OutputBuffer in blocks.
+template<typename OutputBuffer>
+class EscapeStagingBuffer
+{
+ private:
+  static constexpr size_t capacity = 4096;
+
+  OutputBuffer& m_out;
+  size_t m_used = 0;
+  char m_buffer[capacity];
+
+ public:
+  explicit EscapeStagingBuffer(OutputBuffer& out) : m_out(out) { }
+
+  void flush()
+  {
+    m_out.append(m_buffer, m_used);
+    m_used = 0;
+  }
+
+  void append(char const* data, size_t n)
+  {
+    if (m_used + n > capacity)
+    {
+      flush();
+      // Pass large runs on directly.
+      if (n > capacity / 2)
+      {
+        m_out.append(data, n);
+        return;
+      }
+    }
+    std::memcpy(m_buffer + m_used, data, n);
+    m_used += n;
+  }
+
+  // Append the n characters of an escape sequence, stored in an array of CEscapeScanner::max_escape_size characters.
+  void append_escape(char const* escape, size_t n)
+  {
+    if (m_used + CEscapeScanner::max_escape_size > capacity)
+      flush();
+    // Always copying the whole array is faster than copying n characters.
+    std::memcpy(m_buffer + m_used, escape, CEscapeScanner::max_escape_size);
+    m_used += n;
+  }
+
+  void push_back(char c)
+  {
+    if (m_used == capacity)
+      flush();
+    m_buffer[m_used++] = c;
+  }
+};
+
+// Append the C-escaped in to out. OutputBuffer must have append(char const*, size_t), like std::string.
+template<typename OutputBuffer>
+void c_escape(std::string_view in, OutputBuffer& out)
+{
+  CEscapeScanner const& scanner = CEscapeScanner::instance();
+  EscapeStagingBuffer<OutputBuffer> staging(out);
+  char const* p = in.data();
+  char const* const end = p + in.size();
+  while (p != end)
+  {
+    size_t const clean = scanner.clean_prefix(p, end);
+    staging.append(p, clean);
+    p += clean;
+    if (p == end)
+      break;
+    char const* special_end = p + 1;
+    while (special_end != end && !scanner.is_clean(*special_end))
+      ++special_end;
+    // Without a table, also escape one clean byte, in case its presence changes the escape sequence of the last special byte.
+    if (!scanner.context_free() && special_end != end)
+      ++special_end;
+    scanner.escape_special(p, special_end, staging);
+    p = special_end;
+  }
+  staging.flush();
+}
+
+//=============================================================================
+
+using it_escaped_t = utils::c_escape_iterator<std::string_view::const_iterator>;
+
+std::string escape_with_iterator(std::string_view sv)
+{
+  return std::string(it_escaped_t(sv.begin(), sv.end()), it_escaped_t(sv.end(), sv.end()));
+}
+
+std::string escape_bulk(std::string_view sv)
+{
+  std::string result;
+  c_escape(sv, result);
+  return result;
+}
+
+template<typename ESCAPE>
+double gigabytes_per_second(std::string const& input, ESCAPE escape)
+{
+  double best = 1e9;
+  size_t size = 0;
+  for (int round = 0; round < 5; ++round)
+  {
+    auto start = std::chrono::steady_clock::now();
+    size = escape(input);
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  ASSERT(size >= input.size());
+  return input.size() / best * 1e-9;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The same input as c_escape_test.cxx.
+  std::string s = "-=-\t\v\xff-=-\n";
+  std::string escaped = escape_bulk(s);
+  std::cout << "escaped: \"" << escaped << "\"." << std::endl;
+  ASSERT(escaped == escape_with_iterator(s));
+
+  // All single bytes, all pairs of bytes, and random strings with every density of special bytes.
+  for (int c1 = 0; c1 < 256; ++c1)
+    for (int c2 = 0; c2 < 256; ++c2)
+    {
+      char const pair[2] = { static_cast<char>(c1), static_cast<char>(c2) };
+      ASSERT(escape_bulk({ pair, 1 }) == escape_with_iterator({ pair, 1 }));
+      ASSERT(escape_bulk({ pair, 2 }) == escape_with_iterator({ pair, 2 }));
+    }
+  std::mt19937 gen(42);
+  for (int i = 0; i < 10000; ++i)
+  {
+    std::string input = random_input(gen() % 200, (i % 11) / 10.0, gen, "\\\"");
+    ASSERT(escape_bulk(input) == escape_with_iterator(input));
+  }
+
+  constexpr size_t size = 16 * 1024 * 1024;
+  for (double binary_fraction : { 0.001, 0.01, 0.5, 1.0 })
+  {
+    std::string input = random_input(size, binary_fraction, gen, "\\\"");
+    // c_escape appends to an existing buffer, that is reused.
+    std::string buffer;
+    std::cout << binary_fraction * 100 << "% binary: c_escape_iterator " <<
+      gigabytes_per_second(input, [](std::string_view in){ return escape_with_iterator(in).size(); }) << " GB/s, " <<
+      "c_escape " << gigabytes_per_second(input, [&buffer](std::string_view in){ buffer.clear(); c_escape(in, buffer); return buffer.size(); }) << " GB/s." << std::endl;
+  }
+
+  Dout(dc::notice, "Success");
+}
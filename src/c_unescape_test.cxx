@@ -0,0 +1,376 @@
+#include "sys.h"
+#include "debug.h"
+#include "utils/c_escape_iterator.h"
+#include "TestHelpers.h"
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Streaming decoder of C escape sequences, the inverse of utils::c_escape_iterator.
+//
+// The input may be split into chunks at arbitrary positions, also in the middle
+// of an escape sequence: the decoder keeps the state of a partially read escape
+// sequence between calls to decode(). It does not allocate; the caller provides
+// the output buffer. Runs without a backslash are found 16 (SSE2) or 32 (AVX2)
+// bytes at a time and copied with memcpy.
+//
+// Recognized are the simple escape sequences (\a \b \f \n \r \t \v \\ \' \" \?),
+// octal escapes of one to three digits and hexadecimal escapes of one or two
+// digits (\xff followed by an 'a' is not \xffa). Unknown escape sequences and
+// values that don't fit in a byte set the error flag; decoding continues.
+class CUnescapeDecoder
+{
+ private:
+  enum State : uint8_t
+  {
+    normal,
+    backslash,                  // Read a backslash.
+    octal,                      // Read m_count octal digits.
+    hex                         // Read "\x" and m_count hexadecimal digits.
+  };
+
+  State m_state = normal;
+  uint8_t m_count = 0;
+  uint16_t m_value = 0;
+  bool m_error = false;
+
+  static char const* find_backslash(char const* p, char const* end);
+  static int hex_digit(char c);
+
+  // Emit the value of a numeric escape sequence.
+  char* emit_value(char* out)
+  {
+    m_error |= m_value > 0xff;
+    *out++ = static_cast<char>(m_value);
+    m_state = normal;
+    return out;
+  }
+
+ public:
+  // Decode the next chunk. out must have room for chunk.size() + 1 characters.
+  // Returns one past the last character written.
+  char* decode(std::string_view chunk, char* out);
+
+  // Call at the end of the input. out must have room for one character.
+  // Returns one past the last character written. The decoder can then be reused.
+  char* finish(char* out);
+
+  // True if the input so far contained an invalid escape sequence.
+  bool error() const { return m_error; }
+
+  void reset()
+  {
+    m_state = normal;
+    m_error = false;
+  }
+};
+
+//static
+char const* CUnescapeDecoder::find_backslash(char const* p, char const* const end)
+{
+#ifdef __AVX2__
+  __m256i const backslash32 = _mm256_set1_epi8('\\');
+  for (; end - p >= 32; p += 32)
+  {
+    __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+    if (uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslash32)))
+      return p + std::countr_zero(mask);
+  }
+#endif
+#ifdef __SSE2__
+  __m128i const backslash16 = _mm_set1_epi8('\\');
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    if (uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash16)))
+      return p + std::countr_zero(mask);
+  }
+#endif
+  char const* backslash = static_cast<char const*>(std::memchr(p, '\\', end - p));
+  return backslash ? backslash : end;
+}
+
+//static
+int CUnescapeDecoder::hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+char* CUnescapeDecoder::decode(std::string_view chunk, char* out)
+{
+  char const* p = chunk.data();
+  char const* const end = p + chunk.size();
+  while (p != end)
+  {
+    switch (m_state)
+    {
+      case normal:
+      {
+        char const* const backslash = find_backslash(p, end);
+        std::memcpy(out, p, backslash - p);
+        out += backslash - p;
+        p = backslash;
+        if (p != end)
+        {
+          m_state = State::backslash;
+          ++p;
+        }
+        break;
+      }
+      case backslash:
+      {
+        char const c = *p++;
+        m_state = normal;
+        switch (c)
+        {
+          case 'a': *out++ = '\a'; break;
+          case 'b': *out++ = '\b'; break;
+          case 'f': *out++ = '\f'; break;
+          case 'n': *out++ = '\n'; break;
+          case 'r': *out++ = '\r'; break;
+          case 't': *out++ = '\t'; break;
+          case 'v': *out++ = '\v'; break;
+          case '\\': case '\'': case '"': case '?': *out++ = c; break;
+          case 'x':
+            // Fast path for the most common case: two hexadecimal digits in the same chunk.
+            if (end - p >= 2)
+            {
+              int const high = hex_digit(p[0]);
+              int const low = hex_digit(p[1]);
+              if ((high | low) >= 0)
+              {
+                *out++ = static_cast<char>(16 * high + low);
+                p += 2;
+                break;
+              }
+            }
+            m_state = hex;
+            m_count = 0;
+            m_value = 0;
+            break;
+          default:
+            if (c >= '0' && c <= '7')
+            {
+              m_state = octal;
+              m_count = 1;
+              m_value = c - '0';
+            }
+            else
+            {
+              m_error = true;
+              *out++ = c;
+            }
+        }
+        break;
+      }
+      case octal:
+        if (*p >= '0' && *p <= '7')
+        {
+          m_value = 8 * m_value + (*p++ - '0');
+          if (++m_count == 3)
+            out = emit_value(out);
+        }
+        else
+          out = emit_value(out);        // Don't consume *p.
+        break;
+      case hex:
+      {
+        int const digit = hex_digit(*p);
+        if (digit >= 0)
+        {
+          ++p;
+          m_value = 16 * m_value + digit;
+          if (++m_count == 2)
+            out = emit_value(out);
+        }
+        else if (m_count == 0)
+        {
+          m_error = true;               // "\x" without digits.
+          m_state = normal;
+        }
+        else
+          out = emit_value(out);        // Don't consume *p.
+        break;
+      }
+    }
+  }
+  return out;
+}
+
+char* CUnescapeDecoder::finish(char* out)
+{
+  if ((m_state == octal || m_state == hex) && m_count > 0)
+    out = emit_value(out);
+  else if (m_state != normal)
+    m_error = true;                     // Trailing backslash, or "\x".
+  m_state = normal;
+  return out;
+}
+
+//=============================================================================
+
+using it_escaped_t = utils::c_escape_iterator<std::string_view::const_iterator>;
+
+std::string escape(std::string_view sv)
+{
+  return std::string(it_escaped_t(sv.begin(), sv.end()), it_escaped_t(sv.end(), sv.end()));
+}
+
+// Decode in, split into chunks of random sizes (between 1 and max_chunk_size).
+std::string decode_in_chunks(std::string_view in, size_t max_chunk_size, std::mt19937& gen, bool& error)
+{
+  CUnescapeDecoder decoder;
+  std::string result(in.size() + 1, '\0');
+  char* out = result.data();
+  std::uniform_int_distribution<size_t> chunk_size(1, max_chunk_size);
+  while (!in.empty())
+  {
+    size_t n = std::min(chunk_size(gen), in.size());
+    out = decoder.decode(in.substr(0, n), out);
+    in.remove_prefix(n);
+  }
+  out = decoder.finish(out);
+  error = decoder.error();
+  result.resize(out - result.data());
+  return result;
+}
+
+std::string decode(std::string_view in, bool& error)
+{
+  std::mt19937 gen;
+  return decode_in_chunks(in, in.size() + 1, gen, error);
+}
+
+// A straightforward decoder, one character at a time, as a reference for the benchmark.
+std::string decode_slowly(std::string_view in)
+{
+  std::string result;
+  for (size_t i = 0; i < in.size(); ++i)
+  {
+    if (in[i] != '\\' || i + 1 == in.size())
+    {
+      result += in[i];
+      continue;
+    }
+    char c = in[++i];
+    switch (c)
+    {
+      case 'a': result += '\a'; break;
+      case 'b': result += '\b'; break;
+      case 'f': result += '\f'; break;
+      case 'n': result += '\n'; break;
+      case 'r': result += '\r'; break;
+      case 't': result += '\t'; break;
+      case 'v': result += '\v'; break;
+      case 'x':
+      {
+        int value = 0;
+        for (int n = 0; n < 2 && i + 1 < in.size() && std::isxdigit(static_cast<unsigned char>(in[i + 1])); ++n)
+        {
+          char const digit = in[++i];
+          value = 16 * value + (std::isdigit(static_cast<unsigned char>(digit)) ? digit - '0' : (digit | 0x20) - 'a' + 10);
+        }
+        result += static_cast<char>(value);
+        break;
+      }
+      default:
+        if (c >= '0' && c <= '7')
+        {
+          int value = c - '0';
+          for (int n = 1; n < 3 && i + 1 < in.size() && in[i + 1] >= '0' && in[i + 1] <= '7'; ++n)
+            value = 8 * value + (in[++i] - '0');
+          result += static_cast<char>(value);
+        }
+        else
+          result += c;
+    }
+  }
+  return result;
+}
+
+template<typename DECODE>
+double gigabytes_per_second(std::string const& escaped, DECODE decode)
+{
+  double best = 1e9;
+  for (int round = 0; round < 5; ++round)
+  {
+    auto start = std::chrono::steady_clock::now();
+    decode(escaped);
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  return escaped.size() / best * 1e-9;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  bool error;
+  // The same input as c_escape_test.cxx.
+  std::string s = "-=-\t\v\xff-=-\n";
+  std::string escaped = escape(s);
+  std::cout << "escaped: \"" << escaped << "\", unescaped back: " << (decode(escaped, error) == s ? "OK" : "FAILED") << std::endl;
+  ASSERT(decode(escaped, error) == s && !error);
+
+  // Escape sequences that c_escape_iterator might not produce.
+  ASSERT(decode(R"(\101\0\x41\x4g\'\?\"\18)", error) == std::string("A\0A\x04g'?\"\0018", 10) && !error);
+  ASSERT(decode(R"(\q)", error) == "q" && error);
+  ASSERT(decode(R"(\777)", error).size() == 1 && error);
+  ASSERT(decode(R"(\xg)", error) == "g" && error);
+  ASSERT(decode(R"(trailing\)", error) == "trailing" && error);
+  ASSERT(decode(R"(\x4)", error) == "\x04" && !error);
+
+  // Fuzz: escape random strings with c_escape_iterator and decode them again, in random chunks.
+  std::mt19937 gen(42);
+  for (int i = 0; i < 100000; ++i)
+  {
+    std::string original = random_input(gen() % 100, (i % 11) / 10.0, gen, "\\");
+    std::string escaped = escape(original);
+    for (size_t max_chunk_size : { size_t{1}, size_t{3}, size_t{17}, size_t{100} })
+    {
+      ASSERT(decode_in_chunks(escaped, max_chunk_size, gen, error) == original);
+      ASSERT(!error);
+    }
+  }
+
+  constexpr size_t size = 16 * 1024 * 1024;
+  constexpr size_t chunk_size = 65536;
+  std::vector<char> buffer(chunk_size + 1);
+  for (double binary_fraction : { 0.001, 0.01, 0.5, 1.0 })
+  {
+    std::string escaped = escape(random_input(size, binary_fraction, gen, "\\"));
+    size_t decoded_size = 0;
+    std::cout << binary_fraction * 100 << "% binary: one character at a time " <<
+      gigabytes_per_second(escaped, [](std::string const& in){ return decode_slowly(in); }) << " GB/s, " <<
+      "CUnescapeDecoder in chunks of " << chunk_size << " bytes " << gigabytes_per_second(escaped, [&](std::string_view in){
+        CUnescapeDecoder decoder;
+        decoded_size = 0;
+        for (size_t offset = 0; offset < in.size(); offset += chunk_size)
+          decoded_size += decoder.decode(in.substr(offset, chunk_size), buffer.data()) - buffer.data();
+        decoded_size += decoder.finish(buffer.data()) - buffer.data();
+      }) << " GB/s." << std::endl;
+    ASSERT(decoded_size == size);
+  }
+
+  Dout(dc::notice, "Success");
+}
@@ -0,0 +1,188 @@
+#include "sys.h"
+#include "utils/ColorPool.h"
+#include "debug.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// A pool of N colors that hands out the least recently used color, like utils::ColorPool,
+// but with O(1) use_color() and get_color() for N up to 4096.
+//
+// Colors that were never used are older than every used color, and among those
+// the lowest color is the oldest. They are kept in a two level bitset (one summary
+// word with a bit per non-empty 64-bit word), so that the oldest unused color is
+// found with two count-trailing-zeros. Used colors are kept in a doubly linked
+// list, stored as arrays of indices, ordered from least to most recently used.
+template<int N>
+class ScalableColorPool
+{
+  static_assert(N > 0 && N <= 4096, "Two levels of 64-bit words support at most 4096 colors.");
+
+ private:
+  using index_type = std::conditional_t<(N < 256), uint8_t, uint16_t>;
+  static constexpr int words = (N + 63) / 64;
+  static constexpr index_type head = N;         // The sentinel of the circular list.
+
+  uint64_t m_unused_summary;                    // Bit w is set iff m_unused[w] != 0.
+  std::array<uint64_t, words> m_unused;         // The colors that were never used.
+  std::array<index_type, N + 1> m_next;         // Towards more recently used.
+  std::array<index_type, N + 1> m_prev;         // Towards less recently used.
+
+ public:
+  ScalableColorPool() : m_unused_summary(words == 64 ? ~uint64_t{0} : (uint64_t{1} << words) - 1)
+  {
+    m_unused.fill(~uint64_t{0});
+    if (N % 64 != 0)
+      m_unused[words - 1] = (uint64_t{1} << (N % 64)) - 1;
+    m_next[head] = m_prev[head] = head;
+  }
+
+  // Mark color as the most recently used color.
+  void use_color(int color)
+  {
+    ASSERT(0 <= color && color < N);
+    int const w = color >> 6;
+    uint64_t const bit = uint64_t{1} << (color & 63);
+    if ((m_unused[w] & bit))
+    {
+      if (!(m_unused[w] &= ~bit))
+        m_unused_summary &= ~(uint64_t{1} << w);
+    }
+    else
+    {
+      // Unlink.
+      m_next[m_prev[color]] = m_next[color];
+      m_prev[m_next[color]] = m_prev[color];
+    }
+    // Append at the most recently used end.
+    index_type const last = m_prev[head];
+    m_next[last] = color;
+    m_prev[color] = last;
+    m_next[color] = head;
+    m_prev[head] = color;
+  }
+
+  // Return the least recently used color.
+  int get_color() const
+  {
+    if (m_unused_summary)
+    {
+      int const w = std::countr_zero(m_unused_summary);
+      return (w << 6) + std::countr_zero(m_unused[w]);
+    }
+    return m_next[head];
+  }
+};
+
+// The obvious implementation: a time stamp per color and a linear search for the oldest.
+template<int N>
+class NaiveColorPool
+{
+ private:
+  std::array<uint64_t, N> m_last_used{};
+  uint64_t m_now = 0;
+
+ public:
+  void use_color(int color) { m_last_used[color] = ++m_now; }
+
+  int get_color() const
+  {
+    int color = 0;
+    for (int c = 1; c < N; ++c)
+      if (m_last_used[c] < m_last_used[color])
+        color = c;
+    return color;
+  }
+};
+
+template<typename POOL>
+std::string color_pool_test()
+{
+  int input[] = {    0,1,2,0,7,4,3,6,0,3,2,0,5,2,3,1,7,4,6,0,5,2,3,1 };
+  POOL s;
+  std::string result;
+  for (auto c : input)
+  {
+    s.use_color(c);
+    result += '0' + s.get_color();
+  }
+  return result;
+}
+
+// Compare with NaiveColorPool for random uses, and for allocating the returned color.
+template<int N>
+void compare_with_naive()
+{
+  std::mt19937 gen(N);
+  std::uniform_int_distribution<> distrib(0, N - 1);
+  ScalableColorPool<N> pool;
+  NaiveColorPool<N> naive;
+  for (int i = 0; i < 100000; ++i)
+  {
+    int color = (i / 1000) % 2 == 0 ? distrib(gen) : pool.get_color();
+    pool.use_color(color);
+    naive.use_color(color);
+    ASSERT(pool.get_color() == naive.get_color());
+  }
+}
+
+template<typename POOL>
+double benchmark(std::vector<int> const& colors, int iterations)
+{
+  size_t const mask = colors.size() - 1;
+  POOL pool;
+  int sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    pool.use_color(colors[i & mask]);
+    sum += pool.get_color();
+  }
+  auto end = std::chrono::steady_clock::now();
+  asm volatile ("" :: "r" (sum));
+  return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+template<int N>
+void benchmark_over_N()
+{
+  compare_with_naive<N>();
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<> distrib(0, N - 1);
+  std::vector<int> colors(65536);
+  for (int& color : colors)
+    color = distrib(gen);
+  // Keep the run time of NaiveColorPool in check.
+  int const iterations = std::min(10000000, 1000000000 / N);
+  std::cout << "N = " << N << ": ";
+  if constexpr (N == 8)
+    std::cout << "utils::ColorPool " << benchmark<utils::ColorPool<N>>(colors, iterations) << " ns, ";
+  std::cout << "NaiveColorPool " << benchmark<NaiveColorPool<N>>(colors, iterations) << " ns, " <<
+    "ScalableColorPool " << benchmark<ScalableColorPool<N>>(colors, iterations) << " ns per use_color() + get_color()." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  std::string result = color_pool_test<ScalableColorPool<8>>();
+  Dout(dc::notice, result);
+  ASSERT(result == "123333555555111746052317");
+  ASSERT(color_pool_test<NaiveColorPool<8>>() == result);
+
+  benchmark_over_N<8>();
+  benchmark_over_N<64>();
+  benchmark_over_N<100>();
+  benchmark_over_N<256>();
+  benchmark_over_N<1024>();
+  benchmark_over_N<4096>();
+
+  Dout(dc::notice, "Success");
+}
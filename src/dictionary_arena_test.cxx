@@ -0,0 +1,247 @@
+#include "sys.h"
+#include "utils/Dictionary.h"
+#include "debug.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+#include <iterator>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <cstdint>
+
+// A dictionary that interns all words in a single arena.
+//
+// Every word is stored back to back in m_arena, without terminating zero;
+// word i occupies the range [m_offsets[i], m_offsets[i + 1]>. The lookup table
+// only stores indices, hashing and comparing the words through the arena, so
+// the characters of a word don't get a heap allocation (or SSO slack) of their
+// own. The lookup table itself, a std::unordered_set, still allocates a node
+// per word; word_storage() includes those nodes and its bucket array.
+//
+// The std::string_view returned by word() is invalidated by adding words
+// (the arena might reallocate); call reserve() or use add_extra_words if that matters.
+template<typename INDEX>
+class InternedDictionary
+{
+ public:
+  using index_type = INDEX;
+
+ private:
+  std::string m_arena;                          // All words, back to back.
+  std::vector<uint32_t> m_offsets{0};           // Start offset of each word, plus the end of the last word.
+
+  struct Hash
+  {
+    using is_transparent = void;
+    InternedDictionary const* m_dictionary;
+
+    size_t operator()(std::string_view word) const { return std::hash<std::string_view>{}(word); }
+    size_t operator()(index_type index) const { return operator()(m_dictionary->word(index)); }
+  };
+
+  struct Equal
+  {
+    using is_transparent = void;
+    InternedDictionary const* m_dictionary;
+
+    std::string_view view(std::string_view word) const { return word; }
+    std::string_view view(index_type index) const { return m_dictionary->word(index); }
+
+    template<typename T1, typename T2>
+    bool operator()(T1 const& lhs, T2 const& rhs) const { return view(lhs) == view(rhs); }
+  };
+
+  // Counts the bytes allocated by m_lookup (its nodes and its bucket array).
+  template<typename T>
+  struct CountingAllocator
+  {
+    using value_type = T;
+    size_t* m_bytes;
+
+    CountingAllocator(size_t* bytes) : m_bytes(bytes) { }
+    template<typename U> CountingAllocator(CountingAllocator<U> const& other) : m_bytes(other.m_bytes) { }
+
+    T* allocate(size_t n) { *m_bytes += n * sizeof(T); return std::allocator<T>{}.allocate(n); }
+    void deallocate(T* ptr, size_t n) { *m_bytes -= n * sizeof(T); std::allocator<T>{}.deallocate(ptr, n); }
+
+    template<typename U> bool operator==(CountingAllocator<U> const& other) const { return m_bytes == other.m_bytes; }
+  };
+
+  size_t m_lookup_bytes = 0;
+  std::unordered_set<index_type, Hash, Equal, CountingAllocator<index_type>> m_lookup;
+
+ public:
+  InternedDictionary() : m_lookup(0, Hash{this}, Equal{this}, CountingAllocator<index_type>{&m_lookup_bytes}) { }
+  InternedDictionary(InternedDictionary const&) = delete;
+
+  // Reserve space for number_of_words words with a combined length of total_size characters.
+  void reserve(size_t number_of_words, size_t total_size)
+  {
+    m_arena.reserve(m_arena.size() + total_size);
+    m_offsets.reserve(m_offsets.size() + number_of_words);
+    m_lookup.reserve(m_lookup.size() + number_of_words);
+  }
+
+  // Add a word that is not in the dictionary yet and return its index.
+  index_type add_extra_word(std::string_view word)
+  {
+    // Words must be unique.
+    ASSERT(m_lookup.find(word) == m_lookup.end());
+    index_type index = m_offsets.size() - 1;
+    m_arena.append(word);
+    m_offsets.push_back(m_arena.size());
+    m_lookup.insert(index);
+    return index;
+  }
+
+  // Add all words in [first, last>, reserving memory only once.
+  template<typename ForwardIterator>
+  index_type add_extra_words(ForwardIterator first, ForwardIterator last)
+  {
+    size_t total_size = 0;
+    for (ForwardIterator word = first; word != last; ++word)
+      total_size += std::string_view{*word}.size();
+    reserve(std::distance(first, last), total_size);
+    index_type first_index = m_offsets.size() - 1;
+    for (; first != last; ++first)
+      add_extra_word(*first);
+    return first_index;
+  }
+
+  template<typename Range>
+  index_type add_extra_words(Range const& words)
+  {
+    return add_extra_words(std::begin(words), std::end(words));
+  }
+
+  // Return the index of word; throws utils::DictionaryBase::NonExistingWord if it isn't in the dictionary.
+  index_type index(std::string_view word) const
+  {
+    auto iter = m_lookup.find(word);
+    if (iter == m_lookup.end())
+      throw utils::DictionaryBase::NonExistingWord();
+    return *iter;
+  }
+
+  std::string_view word(index_type index) const
+  {
+    return { m_arena.data() + m_offsets[index], m_offsets[index + 1] - m_offsets[index] };
+  }
+
+  size_t size() const { return m_offsets.size() - 1; }
+
+  // The number of bytes used to store the words, including the lookup table (not counting malloc overhead).
+  size_t word_storage() const { return m_arena.capacity() + m_offsets.capacity() * sizeof(uint32_t) + m_lookup_bytes; }
+};
+
+// Bytes used to store the words of a dictionary that uses one std::string per word.
+size_t word_storage(std::vector<std::string> const& words)
+{
+  size_t bytes = words.capacity() * sizeof(std::string);
+  for (std::string const& word : words)
+    if (word.capacity() > 15)                   // Otherwise the string fits in the SSO buffer.
+      bytes += word.capacity() + 1;
+  return bytes;
+}
+
+struct Data { };
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  constexpr int number_of_words = 1000000;
+
+  // Generate unique words with lengths between 4 and 40 characters.
+  std::vector<std::string> words;
+  words.reserve(number_of_words);
+  std::mt19937 gen(0x5dc53d8c);
+  std::uniform_int_distribution<> length_distrib(4, 40);
+  std::uniform_int_distribution<> char_distrib('a', 'z');
+  for (int i = 0; i < number_of_words; ++i)
+  {
+    std::string word = std::to_string(i) + '_';
+    int length = length_distrib(gen);
+    while ((int)word.size() < length)
+      word += char_distrib(gen);
+    words.push_back(std::move(word));
+  }
+
+  // The original: utils::DictionaryData with one std::string per word.
+  utils::DictionaryData<int, std::vector<Data>, int> dictionary;
+  auto start = std::chrono::steady_clock::now();
+  for (std::string const& word : words)
+    dictionary.add_extra_word(word);
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "utils::Dictionary::add_extra_word: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms." << std::endl;
+
+  // The same words interned in an arena, added in bulk.
+  InternedDictionary<int> interned;
+  start = std::chrono::steady_clock::now();
+  interned.add_extra_words(words);
+  end = std::chrono::steady_clock::now();
+  std::cout << "InternedDictionary::add_extra_words: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms." << std::endl;
+
+  ASSERT(interned.size() == words.size());
+  std::cout << "Word storage with one std::string per word: " << word_storage(words) / (1024 * 1024) << " MiB." << std::endl;
+  std::cout << "Word storage of the interning arena, including its lookup table: " << interned.word_storage() / (1024 * 1024) << " MiB." << std::endl;
+
+  // Lookup by index.
+  std::uniform_int_distribution<> index_distrib(0, number_of_words - 1);
+  std::vector<int> indices(number_of_words);
+  for (int& index : indices)
+    index = index_distrib(gen);
+
+  size_t total_length = 0;
+  start = std::chrono::steady_clock::now();
+  for (int index : indices)
+    total_length += dictionary.word(index).size();
+  end = std::chrono::steady_clock::now();
+  std::cout << "utils::Dictionary::word: " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / number_of_words << " ns per lookup." << std::endl;
+
+  size_t interned_total_length = 0;
+  start = std::chrono::steady_clock::now();
+  for (int index : indices)
+    interned_total_length += interned.word(index).size();
+  end = std::chrono::steady_clock::now();
+  std::cout << "InternedDictionary::word: " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / number_of_words << " ns per lookup." << std::endl;
+  ASSERT(total_length == interned_total_length);
+
+  // Lookup by word.
+  long expected_index_sum = 0;
+  for (int index : indices)
+    expected_index_sum += index;
+
+  long index_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int index : indices)
+    index_sum += dictionary.index(words[index]);
+  end = std::chrono::steady_clock::now();
+  std::cout << "utils::Dictionary::index: " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / number_of_words << " ns per lookup." << std::endl;
+  ASSERT(index_sum == expected_index_sum);
+
+  long interned_index_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int index : indices)
+    interned_index_sum += interned.index(words[index]);
+  end = std::chrono::steady_clock::now();
+  std::cout << "InternedDictionary::index: " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / number_of_words << " ns per lookup." << std::endl;
+  ASSERT(interned_index_sum == expected_index_sum);
+
+  // Both must agree on every word.
+  for (int i = 0; i < number_of_words; ++i)
+    ASSERT(interned.word(i) == dictionary.word(i));
+
+  try
+  {
+    interned.index("not a word");
+    ASSERT(false);
+  }
+  catch (utils::DictionaryBase::NonExistingWord const&)
+  {
+  }
+
+  Dout(dc::notice, "Success");
+}
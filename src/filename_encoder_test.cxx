@@ -0,0 +1,576 @@
+#include "sys.h"
+#include "utils/u8string_to_filename.h"
+#define TEST_HELPERS_COUNT_ALLOCATIONS             // Provides number_of_allocations.
+#include "TestHelpers.h"
+#include "debug.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Reusable encoder that does the same as utils::u8string_to_filename(input, illegal, from, to)
+// and utils::filename_to_u8string(filename, to, from), for one fixed (illegal, from, to).
+//
+// Instead of searching the three dictionaries for every glyph of the input, the
+// constructor precomputes what to do with every byte value: copy it, replace it
+// (single-byte glyphs, the replacement is stored in the table) or look up the glyph
+// that starts with it (multi-byte glyphs that occur in one of the dictionaries).
+// Runs of ASCII bytes that are copied are found 16 bytes at a time with SSE2, as
+// long as there are no more than 16 ASCII bytes that need a change.
+//
+// The output can be appended to a std::u8string, or written in one pass, without any
+// allocation, into a caller provided buffer of max_encoded_size() / max_decoded_size()
+// bytes, or into a std::pmr::u8string that is allocated once, with the exact size
+// (counted in a first pass), from a memory resource.
+class FilenameEncoder
+{
+ public:
+  static constexpr char8_t escape_char = u8'%';
+
+ private:
+  enum Class : uint8_t
+  {
+    verbatim,                   // Copy this byte.
+    replace,                    // Single-byte glyph, replace with m_replacement[byte].
+    lookup,                     // First byte of a multi-byte glyph that might have to be replaced.
+    escape                      // Decoding only: the escape character.
+  };
+
+  struct Replacement
+  {
+    uint8_t m_size;
+    char8_t m_bytes[4];
+  };
+
+  struct GlyphReplacement
+  {
+    std::u8string m_glyph;
+    std::u8string m_replacement;
+  };
+
+  struct Table
+  {
+    std::array<Class, 256> m_class;
+    std::array<Replacement, 256> m_replacement;
+    std::vector<GlyphReplacement> m_glyphs;
+#ifdef __SSE2__
+    int m_number_of_specials;   // The number of ASCII bytes that aren't verbatim, or -1 if more than 16.
+    __m128i m_specials[16];
+#endif
+
+    Table() : m_class{} { }
+
+    void add(std::u8string_view glyph, std::u8string_view replacement);
+    void finish();
+    char8_t const* skip_verbatim(char8_t const* p, char8_t const* end) const;
+    template<typename Sink>
+    void append_glyph(Sink& out, char8_t const*& p, char8_t const* end) const;
+  };
+
+  Table m_encode;
+  Table m_decode;
+
+  // The output of encode_to and decode_to.
+  struct StringSink
+  {
+    std::u8string& m_out;
+    void append(char8_t const* p, size_t n) { m_out.append(p, n); }
+    void push_back(char8_t c) { m_out.push_back(c); }
+  };
+
+  struct BufferSink
+  {
+    char8_t* m_out;
+    void append(char8_t const* p, size_t n) { std::memcpy(m_out, p, n); m_out += n; }
+    void push_back(char8_t c) { *m_out++ = c; }
+  };
+
+  struct CountingSink
+  {
+    size_t m_size = 0;
+    void append(char8_t const*, size_t n) { m_size += n; }
+    void push_back(char8_t) { ++m_size; }
+  };
+
+  template<typename Sink>
+  void encode_to(std::u8string_view input, Sink& out) const;
+  template<typename Sink>
+  void decode_to(std::u8string_view filename, Sink& out) const;
+
+ public:
+  FilenameEncoder(std::u8string_view illegal, std::u8string_view from, std::u8string_view to);
+
+  // Append the encoding of input to out.
+  void encode(std::u8string_view input, std::u8string& out) const { StringSink sink{out}; encode_to(input, sink); }
+  // Append the decoding of filename to out.
+  void decode(std::u8string_view filename, std::u8string& out) const { StringSink sink{out}; decode_to(filename, sink); }
+
+  // The exact number of bytes that encode(input, out) writes; this runs the encoder.
+  size_t encoded_size(std::u8string_view input) const { CountingSink sink; encode_to(input, sink); return sink.m_size; }
+  // The exact number of bytes that decode(filename, out) writes; this runs the decoder.
+  size_t decoded_size(std::u8string_view filename) const { CountingSink sink; decode_to(filename, sink); return sink.m_size; }
+
+  // An upper bound of encoded_size() for an input of size bytes: every byte is copied,
+  // escaped (three bytes) or, as a single-byte glyph, replaced by a glyph of at most four bytes.
+  static constexpr size_t max_encoded_size(size_t size) { return 4 * size; }
+  // An upper bound of decoded_size() for a filename of size bytes: a single-byte glyph of 'to'
+  // can be replaced by a glyph of 'from' of at most four bytes; everything else shrinks or stays.
+  static constexpr size_t max_decoded_size(size_t size) { return 4 * size; }
+
+  // Write the encoding of input to out, which must have room for encoded_size(input) bytes;
+  // for example max_encoded_size(input.size()). Returns one past the last byte written.
+  char8_t* encode(std::u8string_view input, char8_t* out) const { BufferSink sink{out}; encode_to(input, sink); return sink.m_out; }
+  // Write the decoding of filename to out, which must have room for decoded_size(filename) bytes;
+  // for example max_decoded_size(filename.size()). Returns one past the last byte written.
+  char8_t* decode(std::u8string_view filename, char8_t* out) const { BufferSink sink{out}; decode_to(filename, sink); return sink.m_out; }
+
+  // Return the encoding of input, allocated with one allocation from resource.
+  std::pmr::u8string encode(std::u8string_view input, std::pmr::memory_resource* resource) const
+  {
+    std::pmr::u8string result(encoded_size(input), u8'\0', resource);
+    encode(input, result.data());
+    return result;
+  }
+
+  // Return the decoding of filename, allocated with one allocation from resource.
+  std::pmr::u8string decode(std::u8string_view filename, std::pmr::memory_resource* resource) const
+  {
+    std::pmr::u8string result(decoded_size(filename), u8'\0', resource);
+    decode(filename, result.data());
+    return result;
+  }
+
+  static size_t glyph_size(char8_t lead)
+  {
+    return lead < 0x80 ? 1 : lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+  }
+
+  static std::vector<std::u8string_view> split_glyphs(std::u8string_view str)
+  {
+    std::vector<std::u8string_view> glyphs;
+    while (!str.empty())
+    {
+      size_t const size = std::min(glyph_size(str[0]), str.size());
+      glyphs.push_back(str.substr(0, size));
+      str.remove_prefix(size);
+    }
+    return glyphs;
+  }
+
+  static void append_escaped(std::u8string& out, std::u8string_view glyph)
+  {
+    static constexpr char8_t hex_digits[] = u8"0123456789ABCDEF";
+    for (char8_t c : glyph)
+    {
+      out += escape_char;
+      out += hex_digits[c >> 4];
+      out += hex_digits[c & 0xf];
+    }
+  }
+};
+
+void FilenameEncoder::Table::add(std::u8string_view glyph, std::u8string_view replacement)
+{
+  char8_t const lead = glyph[0];
+  if (glyph.size() == 1)
+  {
+    ASSERT(replacement.size() <= sizeof(Replacement::m_bytes));
+    m_class[lead] = replace;
+    m_replacement[lead].m_size = replacement.size();
+    std::copy(replacement.begin(), replacement.end(), m_replacement[lead].m_bytes);
+    return;
+  }
+  m_class[lead] = lookup;
+  for (GlyphReplacement& glyph_replacement : m_glyphs)
+    if (glyph_replacement.m_glyph == glyph)
+    {
+      glyph_replacement.m_replacement = replacement;
+      return;
+    }
+  m_glyphs.emplace_back(std::u8string{glyph}, std::u8string{replacement});
+}
+
+void FilenameEncoder::Table::finish()
+{
+#ifdef __SSE2__
+  m_number_of_specials = 0;
+  for (int c = 0; c < 0x80; ++c)
+    if (m_class[c] != verbatim)
+    {
+      if (m_number_of_specials == static_cast<int>(std::size(m_specials)))
+      {
+        m_number_of_specials = -1;
+        break;
+      }
+      m_specials[m_number_of_specials++] = _mm_set1_epi8(c);
+    }
+#endif
+}
+
+// Return a pointer to the first byte in [p, end) that isn't verbatim, or end.
+char8_t const* FilenameEncoder::Table::skip_verbatim(char8_t const* p, char8_t const* const end) const
+{
+  for (;;)
+  {
+#ifdef __SSE2__
+    // Skip ASCII bytes that don't need a change, stopping at any non-ASCII byte.
+    if (m_number_of_specials >= 0)
+      for (; end - p >= 16; p += 16)
+      {
+        __m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+        __m128i special = _mm_setzero_si128();
+        for (int s = 0; s < m_number_of_specials; ++s)
+          special = _mm_or_si128(special, _mm_cmpeq_epi8(v, m_specials[s]));
+        if (uint32_t mask = _mm_movemask_epi8(_mm_or_si128(v, special)))
+        {
+          p += std::countr_zero(mask);
+          break;
+        }
+      }
+#endif
+    if (p == end || m_class[*p] != verbatim)
+      return p;
+    // A verbatim non-ASCII byte, or less than 16 bytes left.
+    do
+      ++p;
+    while (p != end && m_class[*p] == verbatim && *p >= 0x80);
+  }
+}
+
+template<typename Sink>
+void FilenameEncoder::Table::append_glyph(Sink& out, char8_t const*& p, char8_t const* const end) const
+{
+  if (m_class[*p] == replace)
+  {
+    Replacement const& replacement = m_replacement[*p++];
+    out.append(replacement.m_bytes, replacement.m_size);
+    return;
+  }
+  // m_class[*p] == lookup.
+  std::u8string_view const glyph(p, std::min<size_t>(glyph_size(*p), end - p));
+  p += glyph.size();
+  for (GlyphReplacement const& glyph_replacement : m_glyphs)
+    if (glyph_replacement.m_glyph == glyph)
+    {
+      out.append(glyph_replacement.m_replacement.data(), glyph_replacement.m_replacement.size());
+      return;
+    }
+  out.append(glyph.data(), glyph.size());
+}
+
+FilenameEncoder::FilenameEncoder(std::u8string_view illegal_str, std::u8string_view from_str, std::u8string_view to_str)
+{
+  auto const illegal = split_glyphs(illegal_str);
+  auto const from = split_glyphs(from_str);
+  auto const to = split_glyphs(to_str);
+  ASSERT(from.size() == to.size());
+  auto contains = [](std::vector<std::u8string_view> const& dictionary, std::u8string_view glyph){
+    return std::find(dictionary.begin(), dictionary.end(), glyph) != dictionary.end();
+  };
+  std::u8string const escape_str(1, escape_char);
+  std::u8string escaped;
+
+  // Encoding. Add the glyphs in reverse order of precedence: later calls of add() overwrite earlier ones.
+  for (auto const* dictionary : { &illegal, &to })
+    for (std::u8string_view glyph : *dictionary)
+    {
+      escaped.clear();
+      append_escaped(escaped, glyph);
+      m_encode.add(glyph, escaped);
+    }
+  m_encode.add(escape_str, escape_str + escape_str);
+  for (size_t i = from.size(); i-- > 0;)      // If a glyph occurs more than once in from, the first one wins.
+  {
+    if (to[i] != escape_str && !contains(illegal, to[i]))
+      m_encode.add(from[i], to[i]);
+    else
+    {
+      escaped.clear();
+      append_escaped(escaped, from[i]);
+      m_encode.add(from[i], escaped);
+    }
+  }
+  m_encode.finish();
+
+  // Decoding.
+  for (size_t i = to.size(); i-- > 0;)
+    m_decode.add(to[i], from[i]);
+  m_decode.m_class[escape_char] = escape;
+  m_decode.finish();
+}
+
+template<typename Sink>
+void FilenameEncoder::encode_to(std::u8string_view input, Sink& out) const
+{
+  char8_t const* p = input.data();
+  char8_t const* const end = p + input.size();
+  while (p != end)
+  {
+    char8_t const* const verbatim_end = m_encode.skip_verbatim(p, end);
+    out.append(p, verbatim_end - p);
+    p = verbatim_end;
+    if (p != end)
+      m_encode.append_glyph(out, p, end);
+  }
+}
+
+template<typename Sink>
+void FilenameEncoder::decode_to(std::u8string_view filename, Sink& out) const
+{
+  auto hex_digit = [](char8_t c) -> int {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+  };
+  char8_t const* p = filename.data();
+  char8_t const* const end = p + filename.size();
+  while (p != end)
+  {
+    char8_t const* const verbatim_end = m_decode.skip_verbatim(p, end);
+    out.append(p, verbatim_end - p);
+    p = verbatim_end;
+    if (p == end)
+      break;
+    if (m_decode.m_class[*p] != escape)
+      m_decode.append_glyph(out, p, end);
+    else if (end - p >= 2 && p[1] == escape_char)
+    {
+      out.push_back(escape_char);
+      p += 2;
+    }
+    else if (end - p >= 3 && hex_digit(p[1]) >= 0 && hex_digit(p[2]) >= 0)
+    {
+      out.push_back(static_cast<char8_t>(16 * hex_digit(p[1]) + hex_digit(p[2])));
+      p += 3;
+    }
+    else
+      out.push_back(*p++);
+  }
+}
+
+//=============================================================================
+
+std::u8string encode(FilenameEncoder const& encoder, std::u8string_view input)
+{
+  std::u8string result;
+  encoder.encode(input, result);
+  return result;
+}
+
+std::u8string decode(FilenameEncoder const& encoder, std::u8string_view filename)
+{
+  std::u8string result;
+  encoder.decode(filename, result);
+  return result;
+}
+
+struct Configuration
+{
+  std::u8string illegal;
+  std::u8string from;
+  std::u8string to;
+};
+
+// Random valid UTF-8 from a mix of printable ASCII, the glyphs of the configuration, and other multi-byte glyphs.
+std::u8string random_input(Configuration const& configuration, size_t glyphs, std::mt19937& gen)
+{
+  std::u8string const all_glyphs = configuration.illegal + configuration.from + configuration.to + u8"%";
+  std::vector<std::u8string_view> interesting = FilenameEncoder::split_glyphs(all_glyphs);
+  std::vector<std::u8string_view> other = FilenameEncoder::split_glyphs(u8"उदहारण‗﻿é漢字😀");
+  std::uniform_int_distribution<> kind(0, 9);
+  std::uniform_int_distribution<> printable(0x20, 0x7e);
+  std::u8string s;
+  for (size_t i = 0; i < glyphs; ++i)
+  {
+    int k = kind(gen);
+    if (k < 6)
+      s += static_cast<char8_t>(printable(gen));
+    else if (k < 8)
+      s += interesting[gen() % interesting.size()];
+    else
+      s += other[gen() % other.size()];
+  }
+  return s;
+}
+
+template<typename ENCODE>
+double nanoseconds_per_key(std::vector<std::u8string> const& keys, ENCODE encode)
+{
+  double best = 1e9;
+  for (int round = 0; round < 3; ++round)
+  {
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (std::u8string const& key : keys)
+      total += encode(key);
+    auto end = std::chrono::steady_clock::now();
+    asm volatile ("" :: "r" (total));
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / keys.size());
+  }
+  return best;
+}
+
+// Encode number_of_calls keys, cycling through keys, and print the time and the number of heap allocations per key.
+template<typename ENCODE>
+void allocation_benchmark(char const* name, std::vector<std::u8string> const& keys, int number_of_calls, ENCODE encode)
+{
+  size_t total = 0;
+  size_t const allocations_before = number_of_allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < number_of_calls; ++i)
+    total += encode(keys[i % keys.size()]);
+  auto end = std::chrono::steady_clock::now();
+  asm volatile ("" :: "r" (total));
+  std::cout << name << ": " << std::chrono::duration<double, std::nano>(end - start).count() / number_of_calls << " ns and " <<
+    static_cast<double>(number_of_allocations - allocations_before) / number_of_calls << " allocations per key." << std::endl;
+}
+
+void benchmark(char const* name, Configuration const& configuration, std::vector<std::u8string> const& keys)
+{
+  FilenameEncoder const encoder(configuration.illegal, configuration.from, configuration.to);
+  std::u8string buffer;
+  std::cout << name << ": utils::u8string_to_filename " << nanoseconds_per_key(keys, [&](std::u8string const& key){
+      return utils::u8string_to_filename(key, configuration.illegal, configuration.from, configuration.to).native().size();
+    }) << " ns, FilenameEncoder::encode " << nanoseconds_per_key(keys, [&](std::u8string const& key){
+      buffer.clear();
+      encoder.encode(key, buffer);
+      return buffer.size();
+    }) << " ns per key; utils::filename_to_u8string " << nanoseconds_per_key(keys, [&](std::u8string const& key){
+      return utils::filename_to_u8string(std::filesystem::path(key), configuration.to, configuration.from).size();
+    }) << " ns, FilenameEncoder::decode " << nanoseconds_per_key(keys, [&](std::u8string const& key){
+      buffer.clear();
+      encoder.decode(key, buffer);
+      return buffer.size();
+    }) << " ns per key." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The same tests as u8string_to_filename_test.cxx.
+  {
+    std::u8string const from = u8"abcdefghijklmnop";
+    std::u8string const to   = u8"ABCDEFGHIJKLMNOP";
+    std::u8string const illegal = u8"efghmnopqCDGHKLOP";
+    std::u8string const input = u8"abcdefghijklmnopqrABCDEFGHIJKLMNOP";
+    FilenameEncoder encoder(illegal, from, to);
+    std::u8string encoded = encode(encoder, input);
+    std::cout << "Encoded: " << reinterpret_cast<char const*>(encoded.c_str()) << std::endl;
+    ASSERT(encoded == utils::u8string_to_filename(input, illegal, from, to).u8string());
+    ASSERT(decode(encoder, encoded) == input);
+  }
+  {
+    struct Test {
+      std::u8string from;
+      std::u8string to;
+      std::u8string expected;
+    };
+    std::u8string in = u8"a%!/%%42!43%44";
+    Test tests[] = {
+      { u8"",   u8"",   u8"a%%!%2F%%%%42!43%%44" },
+      { u8"%",  u8"!",  u8"a!%21%2F!!42%2143!44" },
+      { u8"!",  u8"%",  u8"a%%%21%2F%%%%42%2143%%44" },
+      { u8"%!", u8"!%", u8"a!%21%2F!!42%2143!44" }
+    };
+    for (Test const& test : tests)
+    {
+      FilenameEncoder encoder(u8"/", test.from, test.to);
+      ASSERT(encode(encoder, in) == test.expected);
+      ASSERT(decode(encoder, test.expected) == in);
+    }
+  }
+
+  // Compare with utils::u8string_to_filename and utils::filename_to_u8string, for random input.
+  Configuration const cache_keys = { u8"/\\:*?\"<>|", u8" ", u8"‗" };
+  Configuration const configurations[] = {
+    cache_keys,
+    { u8"/", u8"", u8"" },
+    { u8"efghmnopqCDGHKLOP", u8"abcdefghijklmnop", u8"ABCDEFGHIJKLMNOP" },
+    { u8"/é", u8"漢 %", u8"é字!" },
+    // More than 16 ASCII bytes that need a change: no SSE2.
+    { u8"/\\:*?\"<>|\x01\x02\x03\x04\x05\x06\x07\x08\x09", u8"ab", u8"AB" }
+  };
+  std::mt19937 gen(42);
+  for (Configuration const& configuration : configurations)
+  {
+    FilenameEncoder encoder(configuration.illegal, configuration.from, configuration.to);
+    for (int i = 0; i < 10000; ++i)
+    {
+      std::u8string input = random_input(configuration, gen() % 64, gen);
+      std::u8string encoded = encode(encoder, input);
+      ASSERT(encoded == utils::u8string_to_filename(input, configuration.illegal, configuration.from, configuration.to).u8string());
+      std::u8string decoded = decode(encoder, encoded);
+      ASSERT(decoded == utils::filename_to_u8string(std::filesystem::path(encoded), configuration.to, configuration.from));
+      ASSERT(decoded == input);
+
+      // The other overloads.
+      ASSERT(encoder.encoded_size(input) == encoded.size());
+      ASSERT(encoder.decoded_size(encoded) == input.size());
+      ASSERT(encoded.size() <= FilenameEncoder::max_encoded_size(input.size()));
+      ASSERT(input.size() <= FilenameEncoder::max_decoded_size(encoded.size()));
+      std::vector<char8_t> buffer(encoded.size() + 1, u8'#');
+      ASSERT(encoder.encode(input, buffer.data()) == buffer.data() + encoded.size());
+      ASSERT(std::u8string_view(buffer.data(), encoded.size()) == encoded && buffer.back() == u8'#');
+      ASSERT(encoder.decode(encoded, buffer.data()) == buffer.data() + input.size());
+      ASSERT(std::u8string_view(buffer.data(), input.size()) == input);
+      std::pmr::monotonic_buffer_resource resource;
+      ASSERT(std::u8string_view(encoder.encode(input, &resource)) == encoded);
+      ASSERT(std::u8string_view(encoder.decode(encoded, &resource)) == input);
+    }
+  }
+
+  // Cache keys: mostly ASCII, or mostly Hindi.
+  constexpr int number_of_keys = 200000;
+  std::vector<std::u8string> ascii_keys;
+  std::vector<std::u8string> unicode_keys;
+  std::u8string const hindi = u8"उदहारण";
+  for (int i = 0; i < number_of_keys; ++i)
+  {
+    std::u8string n(reinterpret_cast<char8_t const*>(std::to_string(i).c_str()));
+    ascii_keys.push_back(u8"textures/atlas_" + n + u8"/level 3:mipmap?format=rgba8_unorm_srgb");
+    unicode_keys.push_back(hindi + u8"/" + hindi + u8" " + n + u8" " + hindi + hindi + u8"‗" + hindi);
+  }
+  benchmark("ASCII keys", cache_keys, ascii_keys);
+  benchmark("Unicode keys", cache_keys, unicode_keys);
+
+  // Generate 10^6 cache file names.
+  {
+    constexpr int number_of_calls = 1000000;
+    FilenameEncoder const encoder(cache_keys.illegal, cache_keys.from, cache_keys.to);
+    allocation_benchmark("utils::u8string_to_filename", ascii_keys, number_of_calls, [&](std::u8string const& key){
+      return utils::u8string_to_filename(key, cache_keys.illegal, cache_keys.from, cache_keys.to).native().size();
+    });
+    allocation_benchmark("FilenameEncoder::encode into a new std::u8string", ascii_keys, number_of_calls, [&](std::u8string const& key){
+      return encode(encoder, key).size();
+    });
+    std::vector<char8_t> buffer;
+    allocation_benchmark("FilenameEncoder::encode into a caller buffer", ascii_keys, number_of_calls, [&](std::u8string const& key){
+      size_t const max_size = FilenameEncoder::max_encoded_size(key.size());
+      if (buffer.size() < max_size)
+        buffer.resize(2 * max_size);    // Rarely happens.
+      return static_cast<size_t>(encoder.encode(key, buffer.data()) - buffer.data());
+    });
+    std::array<std::byte, 4096> arena;
+    std::pmr::monotonic_buffer_resource resource(arena.data(), arena.size(), std::pmr::null_memory_resource());
+    allocation_benchmark("FilenameEncoder::encode into a std::pmr::u8string", ascii_keys, number_of_calls, [&](std::u8string const& key){
+      size_t size = encoder.encode(key, &resource).size();
+      resource.release();
+      return size;
+    });
+  }
+
+  Dout(dc::notice, "Success");
+}
@@ -0,0 +1,247 @@
+#include "sys.h"
+#include "utils/itoa.h"
+#include "debug.h"
+#include <array>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string_view>
+#include <vector>
+
+namespace ftoa_detail {
+
+using uint128_t = unsigned __int128;
+
+// "00" "01" ... "99".
+constexpr std::array<char, 200> digit_pairs = []{
+  std::array<char, 200> table{};
+  for (int i = 0; i < 100; ++i)
+  {
+    table[2 * i] = '0' + i / 10;
+    table[2 * i + 1] = '0' + i % 10;
+  }
+  return table;
+}();
+
+inline int digits(uint64_t x)
+{
+  int n = 1;
+  for (; x >= 100; x /= 100)
+    n += 2;
+  return n + (x >= 10);
+}
+
+// Write the n digits of x immediately before end.
+inline void write_digits(char* end, uint64_t x)
+{
+  while (x >= 100)
+  {
+    uint64_t const r = x % 100;
+    x /= 100;
+    end -= 2;
+    std::memcpy(end, &digit_pairs[2 * r], 2);
+  }
+  if (x >= 10)
+    std::memcpy(end - 2, &digit_pairs[2 * x], 2);
+  else
+    end[-1] = '0' + x;
+}
+
+} // namespace ftoa_detail
+
+// The maximum length of the output of ftoa: "-2.2250738585072014e-308".
+constexpr size_t ftoa_max_size = 24;
+
+// Write the shortest representation of x that converts back to x: fixed or
+// scientific notation, whichever is shorter. Writes at most ftoa_max_size
+// characters (no terminating zero) and returns one past the last character
+// written. Does not allocate and does not use the locale.
+//
+// This is std::to_chars: a dedicated shortest round-trip formatter (Schubfach,
+// with a 128-bit table of powers of ten) was not faster on random doubles.
+inline char* ftoa(char* out, double x)
+{
+  return std::to_chars(out, out + ftoa_max_size, x).ptr;
+}
+
+// Like utils::itoa: write x into buf, zero terminated, and return a pointer to the result.
+template<size_t N>
+char const* ftoa(std::array<char, N>& buf, double x)
+{
+  static_assert(N > ftoa_max_size, "Buffer too small.");
+  *ftoa(buf.data(), x) = 0;
+  return buf.data();
+}
+
+// Write x with precision digits after the decimal point, like printf("%.*f", precision, x),
+// into [out, last). Returns one past the last character written, or nullptr if the range is too small.
+//
+// Values less than 2^64 with a precision of at most 18 digits are rounded exactly with
+// 128-bit integer arithmetic; everything else is passed on to std::to_chars.
+inline char* ftoa_fixed(char* out, char* last, double x, int precision)
+{
+  uint64_t const bits = std::bit_cast<uint64_t>(x);
+  uint64_t const ieee_significand = bits & ((uint64_t{1} << 52) - 1);
+  int const ieee_exponent = (bits >> 52) & 0x7ff;
+  uint64_t const m = ieee_exponent ? (uint64_t{1} << 52) | ieee_significand : ieee_significand;
+  int const e = ieee_exponent ? ieee_exponent - 1075 : -1074;
+  if (ieee_exponent == 0x7ff || e > 11 || precision < 0 || precision > 18)
+  {
+    auto [end, ec] = std::to_chars(out, last, x, std::chars_format::fixed, precision);
+    return ec == std::errc{} ? end : nullptr;
+  }
+
+  // x * 10^precision, rounded to the nearest integer (to even in case of a tie).
+  uint64_t pow10 = 1;
+  for (int i = 0; i < precision; ++i)
+    pow10 *= 10;
+  ftoa_detail::uint128_t q;
+  if (e >= 0)
+    q = ftoa_detail::uint128_t{m << e} * pow10;
+  else
+  {
+    int const shift = -e;
+    ftoa_detail::uint128_t const scaled = ftoa_detail::uint128_t{m} * pow10;
+    if (shift >= 128)
+      q = 0;                    // scaled < 2^113, so less than half.
+    else
+    {
+      q = scaled >> shift;
+      ftoa_detail::uint128_t const remainder = scaled - (q << shift);
+      ftoa_detail::uint128_t const half = ftoa_detail::uint128_t{1} << (shift - 1);
+      q += remainder > half || (remainder == half && (q & 1));
+    }
+  }
+  uint64_t const integral_part = q / pow10;
+  uint64_t const fractional_part = q % pow10;
+
+  int const n = ftoa_detail::digits(integral_part);
+  size_t const size = (bits >> 63) + n + (precision > 0) + precision;
+  if (size > static_cast<size_t>(last - out))
+    return nullptr;
+  if (bits >> 63)
+    *out++ = '-';
+  ftoa_detail::write_digits(out + n, integral_part);
+  out += n;
+  if (precision > 0)
+  {
+    *out++ = '.';
+    std::memset(out, '0', precision);
+    if (fractional_part)
+      ftoa_detail::write_digits(out + precision, fractional_part);
+    out += precision;
+  }
+  return out;
+}
+
+// Like utils::itoa: write x into buf, zero terminated, and return a pointer to the result; or nullptr if buf is too small.
+template<size_t N>
+char const* ftoa_fixed(std::array<char, N>& buf, double x, int precision)
+{
+  char* end = ftoa_fixed(buf.data(), buf.data() + N - 1, x, precision);
+  if (!end)
+    return nullptr;
+  *end = 0;
+  return buf.data();
+}
+
+//=============================================================================
+
+void check_fixed(double x, int precision)
+{
+  char expected[400];
+  char result[400];
+  std::string_view e(expected, std::to_chars(expected, expected + sizeof(expected), x, std::chars_format::fixed, precision).ptr - expected);
+  char* end = ftoa_fixed(result, result + sizeof(result), x, precision);
+  ASSERT(end);
+  std::string_view r(result, end - result);
+  if (e != r)
+    DoutFatal(dc::core, "ftoa_fixed(" << std::hexfloat << x << ", " << precision << ") = \"" << r << "\", expected \"" << e << "\".");
+}
+
+template<typename FORMAT>
+void benchmark(char const* name, std::vector<double> const& values, FORMAT format)
+{
+  std::vector<char> buffer(values.size() * 400);
+  double best = 1e9;
+  for (int round = 0; round < 3; ++round)
+  {
+    char* out = buffer.data();
+    auto start = std::chrono::steady_clock::now();
+    for (double x : values)
+    {
+      out = format(out, x);
+      *out++ = '\n';
+    }
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  asm volatile ("" :: "r" (buffer.data()) : "memory");
+  std::cout << "  " << name << ": " << values.size() / best * 1e-6 << " M doubles/s." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  std::mt19937_64 gen(42);
+
+  for (int precision = 0; precision <= 20; ++precision)
+  {
+    for (double x : { 0.0, -0.0, 0.5, 1.5, 2.5, 0.125, 0.375, 2.675, 1e-30, -1e-30, 0x1p63, 0x1p64, 1e300, 0.1, 123.456 })
+      check_fixed(x, precision);
+    // 53-bit significands times 2^-128 ... 2^12: both the exact path and the fallback.
+    for (int i = 0; i < 100000; ++i)
+      check_fixed(std::ldexp(static_cast<double>(gen() >> 11), static_cast<int>(gen() % 141) - 128), precision);
+  }
+
+  std::array<char, 32> buf;
+  ASSERT(std::string_view(ftoa(buf, 3.14)) == "3.14");
+  ASSERT(std::string_view(ftoa(buf, -2.2250738585072014e-308)).size() == ftoa_max_size);
+  ASSERT(std::string_view(ftoa_fixed(buf, 3.14159, 2)) == "3.14");
+  std::array<char, 4> small_buf;
+  ASSERT(ftoa_fixed(small_buf, 3.14159, 2) == nullptr);
+
+  constexpr int count = 1000000;
+  std::vector<double> random_doubles;
+  std::vector<double> prices;
+  for (int i = 0; i < count; ++i)
+  {
+    double x;
+    do { x = std::bit_cast<double>(gen()); } while (!std::isfinite(x));
+    random_doubles.push_back(x);
+    prices.push_back((gen() % 10000000) / 100.0);
+  }
+
+  std::ostringstream oss;
+  auto ostream_format = [&oss](char* out, double x){
+    oss.str({});
+    oss << x;
+    std::string_view s = oss.view();
+    std::memcpy(out, s.data(), s.size());
+    return out + s.size();
+  };
+
+  for (auto* values : { &random_doubles, &prices })
+  {
+    std::cout << (values == &prices ? "Prices (two decimals):" : "Random bit patterns:") << std::endl;
+    oss.str({});
+    oss << std::setprecision(17);
+    benchmark("ostream << double (precision 17)", *values, ostream_format);
+    benchmark("std::to_chars (ftoa)", *values, [](char* out, double x){ return ftoa(out, x); });
+  }
+  std::cout << "Prices, fixed with two decimals:" << std::endl;
+  oss << std::fixed << std::setprecision(2);
+  benchmark("ostream << std::fixed << double", prices, ostream_format);
+  benchmark("std::to_chars", prices, [](char* out, double x){ return std::to_chars(out, out + 32, x, std::chars_format::fixed, 2).ptr; });
+  benchmark("ftoa_fixed", prices, [](char* out, double x){ return ftoa_fixed(out, out + 32, x, 2); });
+
+  Dout(dc::notice, "Success");
+}
@@ -0,0 +1,155 @@
+#include "sys.h"
+#include "utils/threading/Gate.h"
+#include "debug.h"
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <iostream>
+#include <cstdint>
+
+// A Gate built on std::atomic::wait (a futex on linux).
+//
+// Like utils::threading::Gate: wait() blocks until open() was called,
+// after which the gate stays open. A waiter first spins for a while
+// (adaptively: the spin limit follows the number of spins that were
+// needed recently) before it parks in the kernel. On a uniprocessor
+// spinning is pointless, so it parks right away. open() only makes a
+// syscall when there is a parked waiter.
+class FutexGate
+{
+ private:
+  static constexpr uint32_t closed = 0;         // Nobody is parked.
+  static constexpr uint32_t parked = 1;         // At least one thread is (about to be) parked.
+  static constexpr uint32_t opened = 2;
+
+  static int const s_min_spin;
+  static int const s_max_spin;
+
+  std::atomic<uint32_t> m_state{closed};
+
+  // The adaptive spin limit of the current thread.
+  static thread_local int t_spin_limit;
+
+  static void cpu_relax()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+ public:
+  void wait()
+  {
+    // Spin phase.
+    for (int spin = 0; spin < t_spin_limit; ++spin)
+    {
+      if (m_state.load(std::memory_order_acquire) == opened)
+      {
+        // Move the spin limit towards what was needed this time (with some margin).
+        t_spin_limit = std::clamp(t_spin_limit + (2 * spin - t_spin_limit) / 8, s_min_spin, s_max_spin);
+        return;
+      }
+      cpu_relax();
+    }
+    // Spinning did not help; spin less next time.
+    t_spin_limit = std::max(s_min_spin, t_spin_limit / 2);
+
+    // Park phase.
+    uint32_t state = closed;
+    if (!m_state.compare_exchange_strong(state, parked, std::memory_order_acquire) && state == opened)
+      return;
+    while (m_state.load(std::memory_order_acquire) != opened)
+      m_state.wait(parked, std::memory_order_acquire);
+  }
+
+  void open()
+  {
+    if (m_state.exchange(opened, std::memory_order_release) == parked)
+      m_state.notify_all();
+  }
+
+  bool is_open() const { return m_state.load(std::memory_order_acquire) == opened; }
+};
+
+//static
+int const FutexGate::s_min_spin = std::thread::hardware_concurrency() > 1 ? 16 : 0;
+//static
+int const FutexGate::s_max_spin = std::thread::hardware_concurrency() > 1 ? 4096 : 0;
+//static
+thread_local int FutexGate::t_spin_limit = FutexGate::s_max_spin;
+
+// Measure the one-way wake-up latency by bouncing between two threads, using
+// a fresh gate for every hand-off. Returns the latencies in nanoseconds, sorted.
+template<typename GATE>
+std::vector<long> ping_pong(int round_trips)
+{
+  std::deque<GATE> ping(round_trips);
+  std::deque<GATE> pong(round_trips);
+
+  std::thread ponger([&](){
+    for (int i = 0; i < round_trips; ++i)
+    {
+      ping[i].wait();
+      pong[i].open();
+    }
+  });
+
+  std::vector<long> latencies;
+  latencies.reserve(round_trips);
+  for (int i = 0; i < round_trips; ++i)
+  {
+    auto start = std::chrono::steady_clock::now();
+    ping[i].open();
+    pong[i].wait();
+    auto end = std::chrono::steady_clock::now();
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 2);
+  }
+  ponger.join();
+
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+template<typename GATE>
+void print_latencies(char const* name, int round_trips)
+{
+  std::vector<long> latencies = ping_pong<GATE>(round_trips);
+  std::cout << name << ": p50 = " << latencies[latencies.size() / 2] << " ns, p99 = " << latencies[latencies.size() * 99 / 100] << " ns." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // A gate that is opened before anyone waits does not block.
+  {
+    FutexGate gate;
+    gate.open();
+    gate.wait();
+    ASSERT(gate.is_open());
+  }
+
+  // Make sure that parked threads are woken up.
+  {
+    FutexGate gate;
+    std::atomic<int> passed{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+      threads.emplace_back([&](){ gate.wait(); ++passed; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT(passed == 0);
+    gate.open();
+    for (std::thread& thread : threads)
+      thread.join();
+    ASSERT(passed == 4);
+  }
+
+  constexpr int round_trips = 100000;
+  print_latencies<utils::threading::Gate>("utils::threading::Gate", round_trips);
+  print_latencies<FutexGate>("FutexGate", round_trips);
+
+  Dout(dc::notice, "Success");
+}
@@ -0,0 +1,336 @@
+#include "sys.h"
+#include "utils/itoa.h"
+#include "debug.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace bulk_itoa_detail {
+
+// "00" "01" ... "99".
+constexpr std::array<char, 200> digit_pairs = []{
+  std::array<char, 200> table{};
+  for (int i = 0; i < 100; ++i)
+  {
+    table[2 * i] = '0' + i / 10;
+    table[2 * i + 1] = '0' + i % 10;
+  }
+  return table;
+}();
+
+// 10^i, except that the first entry is 0 (so that digits(0) returns 1).
+constexpr std::array<uint64_t, 20> powers_of_ten = []{
+  std::array<uint64_t, 20> table{};
+  uint64_t p = 1;
+  for (int i = 1; i < 20; ++i)
+    table[i] = p *= 10;
+  return table;
+}();
+
+// The number of decimal digits of x, without branches: log10(x) is approximated
+// from log2(x) (1233 / 4096 ~ log10(2)) and then corrected by one comparison.
+template<typename U>
+int digits(U x)
+{
+  int t = (std::bit_width(x | 1) * 1233) >> 12;
+  return t + (x >= powers_of_ten[t]);
+}
+
+#ifdef __SSE2__
+// Convert x < 100000000 into eight 16-bit digits (most significant first).
+inline __m128i eight_digits(uint32_t x)
+{
+  __m128i const abcdefgh = _mm_cvtsi32_si128(x);
+  // abcd = abcdefgh / 10000, efgh = abcdefgh % 10000.
+  __m128i const abcd = _mm_srli_epi64(_mm_mul_epu32(abcdefgh, _mm_set1_epi32(0xd1b71759)), 45);
+  __m128i const efgh = _mm_sub_epi32(abcdefgh, _mm_mul_epu32(abcd, _mm_set1_epi32(10000)));
+  // [ abcd * 4, abcd * 4, abcd * 4, abcd * 4, efgh * 4, efgh * 4, efgh * 4, efgh * 4 ].
+  __m128i const v1 = _mm_slli_epi64(_mm_unpacklo_epi16(abcd, efgh), 2);
+  __m128i const v2 = _mm_unpacklo_epi32(_mm_unpacklo_epi16(v1, v1), _mm_unpacklo_epi16(v1, v1));
+  // Divide by 1000, 100, 10 and 1: [ a, ab, abc, abcd, e, ef, efg, efgh ].
+  __m128i const v3 = _mm_mulhi_epu16(v2, _mm_setr_epi16(8389, 5243, 13108, -32768, 8389, 5243, 13108, -32768));
+  __m128i const v4 = _mm_mulhi_epu16(v3, _mm_setr_epi16(1 << 7, 1 << 11, 1 << 13, -32768, 1 << 7, 1 << 11, 1 << 13, -32768));
+  // Subtract ten times the previous lane: [ a, b, c, d, e, f, g, h ].
+  __m128i const v5 = _mm_mullo_epi16(v4, _mm_set1_epi16(10));
+  return _mm_sub_epi16(v4, _mm_slli_epi64(v5, 16));
+}
+#endif
+
+// Write the digits of x immediately before end.
+template<typename U>
+void write_digits(char* end, U x)
+{
+#ifdef __SSE2__
+  // Eight digits at a time, while there are more than eight.
+  while (x >= 100000000)
+  {
+    U const r = x % 100000000;
+    x /= 100000000;
+    end -= 8;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(end), _mm_add_epi8(_mm_packus_epi16(eight_digits(r), _mm_setzero_si128()), _mm_set1_epi8('0')));
+  }
+#endif
+  while (x >= 100)
+  {
+    U const r = x % 100;
+    x /= 100;
+    end -= 2;
+    std::memcpy(end, &digit_pairs[2 * r], 2);
+  }
+  if (x >= 10)
+    std::memcpy(end - 2, &digit_pairs[2 * x], 2);
+  else
+    end[-1] = '0' + x;
+}
+
+} // namespace bulk_itoa_detail
+
+// The size of the buffer that bulk_itoa needs for count values of type T (including separators).
+template<typename T>
+constexpr size_t bulk_itoa_max_size(size_t count)
+{
+  return count * (std::numeric_limits<T>::digits10 + 1 + std::is_signed_v<T> + 1);
+}
+
+// Format all values, separated by separator, into out. Returns one past the last character written.
+// The buffer must have room for at least bulk_itoa_max_size<T>(values.size()) characters.
+template<typename T>
+char* bulk_itoa(std::span<T const> values, char separator, char* out)
+{
+  static_assert(std::is_integral_v<T>, "T must be an integral type.");
+  using U = std::conditional_t<(sizeof(T) <= 4), uint32_t, uint64_t>;
+  for (T value : values)
+  {
+    U x = static_cast<U>(value);
+    if constexpr (std::is_signed_v<T>)
+    {
+      *out = '-';
+      out += value < 0;
+      x = value < 0 ? U{0} - x : x;
+    }
+    int const n = bulk_itoa_detail::digits(x);
+    bulk_itoa_detail::write_digits(out + n, x);
+    out += n;
+    *out++ = separator;
+  }
+  // No separator after the last value.
+  return values.empty() ? out : out - 1;
+}
+
+// Format all values with exactly Width digits (with leading zeroes), separated by separator, into out.
+// All values must be less than 10^Width. Returns one past the last character written.
+template<int Width>
+char* bulk_itoa_fixed_width(std::span<uint64_t const> values, char separator, char* out)
+{
+  static_assert(1 <= Width && Width <= 16, "Width must be in the range [1, 16].");
+  for (uint64_t value : values)
+  {
+    ASSERT(value < bulk_itoa_detail::powers_of_ten[Width]);
+#ifdef __SSE2__
+    char digits[16];
+    if constexpr (Width <= 8)
+    {
+      __m128i const v = _mm_add_epi8(_mm_packus_epi16(bulk_itoa_detail::eight_digits(value), _mm_setzero_si128()), _mm_set1_epi8('0'));
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(digits), v);
+      std::memcpy(out, digits + 8 - Width, Width);
+    }
+    else
+    {
+      __m128i const high = bulk_itoa_detail::eight_digits(value / 100000000);
+      __m128i const low = bulk_itoa_detail::eight_digits(value % 100000000);
+      __m128i const v = _mm_add_epi8(_mm_packus_epi16(high, low), _mm_set1_epi8('0'));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(digits), v);
+      std::memcpy(out, digits + 16 - Width, Width);
+    }
+#else
+    bulk_itoa_detail::write_digits(out + Width, value);
+    std::fill(out, out + Width - bulk_itoa_detail::digits(value), '0');
+#endif
+    out[Width] = separator;
+    out += Width + 1;
+  }
+  return values.empty() ? out : out - 1;
+}
+
+//=============================================================================
+// Reference implementations.
+
+template<typename T>
+char* to_chars_bulk(std::span<T const> values, char separator, char* out)
+{
+  for (T value : values)
+  {
+    out = std::to_chars(out, out + 24, value).ptr;
+    *out++ = separator;
+  }
+  return values.empty() ? out : out - 1;
+}
+
+template<typename T>
+char* utils_itoa_bulk(std::span<T const> values, char separator, char* out)
+{
+  std::array<char, std::numeric_limits<T>::digits10 + 3> buf;
+  for (T value : values)
+  {
+    // utils::itoa writes a zero terminated string into the end of buf.
+    char const* str = utils::itoa(buf, value);
+    size_t len = buf.data() + buf.size() - 1 - str;
+    std::memcpy(out, str, len);
+    out += len;
+    *out++ = separator;
+  }
+  return values.empty() ? out : out - 1;
+}
+
+template<int Width>
+char* to_chars_fixed_width(std::span<uint64_t const> values, char separator, char* out)
+{
+  for (uint64_t value : values)
+  {
+    char* end = std::to_chars(out, out + Width, value).ptr;
+    size_t len = end - out;
+    std::memmove(out + Width - len, out, len);
+    std::fill(out, out + Width - len, '0');
+    out[Width] = separator;
+    out += Width + 1;
+  }
+  return values.empty() ? out : out - 1;
+}
+
+//=============================================================================
+
+template<typename T>
+std::vector<T> random_values(size_t count)
+{
+  // Uniformly distributed number of digits (and sign).
+  std::mt19937_64 gen(42);
+  std::vector<T> values(count);
+  for (T& value : values)
+  {
+    uint64_t x = gen() >> (gen() % 64);
+    value = static_cast<T>(x);
+  }
+  return values;
+}
+
+template<typename T>
+void check()
+{
+  std::vector<T> values = random_values<T>(100000);
+  for (T edge : { std::numeric_limits<T>::min(), std::numeric_limits<T>::max(), T{0}, T{1}, T{9}, T{10}, T{99}, T{100} })
+    values.push_back(edge);
+  for (T x = 1; x < std::numeric_limits<T>::max() / 10; x *= 10)
+  {
+    values.push_back(x - 1);
+    values.push_back(x);
+  }
+  std::vector<char> expected(bulk_itoa_max_size<T>(values.size()));
+  std::vector<char> result(bulk_itoa_max_size<T>(values.size()));
+  std::string_view e(expected.data(), to_chars_bulk<T>(values, ',', expected.data()) - expected.data());
+  std::string_view r(result.data(), bulk_itoa<T>(values, ',', result.data()) - result.data());
+  ASSERT(e == r);
+  r = std::string_view(result.data(), utils_itoa_bulk<T>(values, ',', result.data()) - result.data());
+  ASSERT(e == r);
+  ASSERT(bulk_itoa<T>({}, ',', result.data()) == result.data());
+}
+
+template<int Width>
+void check_fixed_width()
+{
+  std::vector<uint64_t> values = random_values<uint64_t>(10000);
+  for (uint64_t& value : values)
+    value %= bulk_itoa_detail::powers_of_ten[Width];
+  values.push_back(0);
+  values.push_back(bulk_itoa_detail::powers_of_ten[Width] - 1);
+  std::vector<char> expected(values.size() * (Width + 1));
+  std::vector<char> result(values.size() * (Width + 1));
+  std::string_view e(expected.data(), to_chars_fixed_width<Width>(values, '\n', expected.data()) - expected.data());
+  std::string_view r(result.data(), bulk_itoa_fixed_width<Width>(values, '\n', result.data()) - result.data());
+  ASSERT(e == r);
+}
+
+template<typename FORMAT>
+void benchmark(char const* name, size_t count, size_t buffer_size, FORMAT format)
+{
+  std::vector<char> buffer(buffer_size);
+  double best = 1e9;
+  size_t size = 0;
+  for (int round = 0; round < 5; ++round)
+  {
+    auto start = std::chrono::steady_clock::now();
+    size = format(buffer.data()) - buffer.data();
+    auto end = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+  asm volatile ("" :: "r" (buffer.data()) : "memory");
+  std::cout << "  " << name << ": " << count / best * 1e-6 << " M integers/s (" << size << " bytes)." << std::endl;
+}
+
+template<typename T>
+void benchmark_type(char const* type_name)
+{
+  constexpr size_t count = 10000000;
+  std::vector<T> values = random_values<T>(count);
+  std::span<T const> span(values);
+  size_t const size = bulk_itoa_max_size<T>(count);
+  std::cout << type_name << ":" << std::endl;
+  benchmark("std::to_chars", count, size, [span](char* out){ return to_chars_bulk(span, ',', out); });
+  benchmark("utils::itoa", count, size, [span](char* out){ return utils_itoa_bulk(span, ',', out); });
+  benchmark("bulk_itoa", count, size, [span](char* out){ return bulk_itoa(span, ',', out); });
+}
+
+template<int Width>
+void benchmark_fixed_width()
+{
+  constexpr size_t count = 10000000;
+  std::vector<uint64_t> values = random_values<uint64_t>(count);
+  for (uint64_t& value : values)
+    value %= bulk_itoa_detail::powers_of_ten[Width];
+  std::span<uint64_t const> span(values);
+  size_t const size = count * (Width + 1);
+  std::cout << Width << " digits, zero padded:" << std::endl;
+  benchmark("std::to_chars", count, size, [span](char* out){ return to_chars_fixed_width<Width>(span, '\n', out); });
+  benchmark("bulk_itoa_fixed_width", count, size, [span](char* out){ return bulk_itoa_fixed_width<Width>(span, '\n', out); });
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  check<int16_t>();
+  check<uint16_t>();
+  check<int32_t>();
+  check<uint32_t>();
+  check<int64_t>();
+  check<uint64_t>();
+  check_fixed_width<1>();
+  check_fixed_width<6>();
+  check_fixed_width<8>();
+  check_fixed_width<12>();
+  check_fixed_width<16>();
+
+  char buf[32];
+  int const values[] = { 1, -20, 300 };
+  ASSERT(std::string_view(buf, bulk_itoa<int>(values, ' ', buf) - buf) == "1 -20 300");
+
+  benchmark_type<uint32_t>("uint32_t");
+  benchmark_type<int64_t>("int64_t");
+  benchmark_fixed_width<8>();
+  benchmark_fixed_width<16>();
+
+  Dout(dc::notice, "Success");
+}
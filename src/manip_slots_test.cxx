@@ -0,0 +1,364 @@
+#include "sys.h"
+#include "utils/iomanip.h"
+#define TEST_HELPERS_COUNT_ALLOCATIONS             // Provides number_of_allocations.
+#include "TestHelpers.h"
+#include "debug.h"
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+
+// Per-stream manipulator storage with a single std::ios_base::xalloc() index.
+//
+// Every utils::iomanip::Index claims its own xalloc index, and std::ios_base keeps the
+// iword/pword of every index up to the largest one used in an array per stream. libstdc++
+// stores the first eight of those inline; a stream that uses a larger index grows the
+// array on the heap, and a program with many manipulators (libcwd has some too) quickly
+// gets there.
+//
+// Here all SlotIndex objects share one xalloc index, claimed during static initialization.
+// Its pword points to a StreamSlots block with room for max_slots iword/pword pairs, and
+// every SlotIndex is a fixed offset into that block. The blocks are recycled through a per
+// thread free list when a stream is destroyed, so that creating streams over and over
+// doesn't allocate them again.
+//
+// This only reduces the per stream cost (allocations and xalloc indices). Finding the slot
+// of a manipulator still takes a pword() lookup (of the shared index) plus an offset, which
+// is as fast as the pword() lookup of utils::iomanip: with libstdc++ that is an inline bounds
+// check plus a load. Caching the last used (stream, StreamSlots) pair per thread, validated
+// by a global epoch that is incremented whenever a stream loses its StreamSlots, was measured
+// to be slower than that (a thread_local plus an atomic load); see read_manipulators below.
+namespace slots {
+
+constexpr int max_slots = 16;
+
+class SlotIndex
+{
+ private:
+  static int s_next_slot;
+  int m_slot;
+
+ public:
+  SlotIndex() : m_slot(s_next_slot++)
+  {
+    // Not an ASSERT: a slot beyond max_slots would be written past the end of StreamSlots::m_slots.
+    if (m_slot >= max_slots)
+      DoutFatal(dc::core, "Too many SlotIndex objects; increase slots::max_slots (" << max_slots << ").");
+  }
+  operator int() const { return m_slot; }
+};
+
+//static
+int SlotIndex::s_next_slot;
+
+struct Slot
+{
+  long m_iword;
+  void* m_pword;
+};
+
+class StreamSlots
+{
+ private:
+  std::array<Slot, max_slots> m_slots;
+  StreamSlots* m_next_free;
+
+  static int const s_xalloc_index;
+
+  // The StreamSlots of streams that were destroyed.
+  struct FreeList
+  {
+    StreamSlots* m_head = nullptr;
+
+    ~FreeList()
+    {
+      t_free_list_destroyed = true;
+      while (m_head)
+        delete std::exchange(m_head, m_head->m_next_free);
+    }
+  };
+  static thread_local FreeList s_free_list;
+  // Set when s_free_list was destroyed; a stream that is destroyed after that (for example
+  // a static stream at program exit) deletes its StreamSlots directly. Being trivially
+  // destructible, this flag itself can still be read at that point.
+  static thread_local bool t_free_list_destroyed;
+
+  static StreamSlots* create()
+  {
+    StreamSlots* stream_slots = t_free_list_destroyed ? nullptr : s_free_list.m_head;
+    if (stream_slots)
+      s_free_list.m_head = stream_slots->m_next_free;
+    else
+      stream_slots = new StreamSlots;
+    stream_slots->m_slots.fill({});
+    return stream_slots;
+  }
+
+  static void destroy(StreamSlots* stream_slots)
+  {
+    if (t_free_list_destroyed)
+    {
+      delete stream_slots;
+      return;
+    }
+    stream_slots->m_next_free = s_free_list.m_head;
+    s_free_list.m_head = stream_slots;
+  }
+
+  static void callback(std::ios_base::event event, std::ios_base& ios, int index)
+  {
+    void*& pword = ios.pword(index);
+    if (event == std::ios_base::erase_event)
+    {
+      // The stream is destroyed, or copyfmt() is about to overwrite the pword.
+      destroy(static_cast<StreamSlots*>(pword));
+      pword = nullptr;
+    }
+    else if (event == std::ios_base::copyfmt_event)
+    {
+      // copyfmt() copied the pointer of the other stream: make a copy of the slots.
+      StreamSlots* stream_slots = create();
+      stream_slots->m_slots = static_cast<StreamSlots*>(pword)->m_slots;
+      pword = stream_slots;
+    }
+  }
+
+ public:
+  static Slot& slot(std::ios_base& ios, SlotIndex const& index)
+  {
+    void*& pword = ios.pword(s_xalloc_index);
+    if (!pword)
+    {
+      pword = create();
+      ios.register_callback(callback, s_xalloc_index);
+    }
+    return static_cast<StreamSlots*>(pword)->m_slots[index];
+  }
+};
+
+//static
+int const StreamSlots::s_xalloc_index = std::ios_base::xalloc();
+//static
+thread_local StreamSlots::FreeList StreamSlots::s_free_list;
+//static
+thread_local bool StreamSlots::t_free_list_destroyed;
+
+// Like utils::iomanip::Unsticky, for a manipulator that is passed as a temporary:
+// the values are in effect until the end of the full expression.
+class SlotUnsticky
+{
+ private:
+  SlotIndex const& m_index;
+  Slot m_value;
+  Slot m_saved;
+  Slot* m_slot = nullptr;
+
+ protected:
+  SlotUnsticky(SlotIndex const& index, long iword, void* pword) : m_index(index), m_value{iword, pword} { }
+
+  static long get_iword_from(std::ios_base& ios, SlotIndex const& index) { return StreamSlots::slot(ios, index).m_iword; }
+  static void* get_pword_from(std::ios_base& ios, SlotIndex const& index) { return StreamSlots::slot(ios, index).m_pword; }
+
+ public:
+  ~SlotUnsticky()
+  {
+    if (m_slot)
+      *m_slot = m_saved;
+  }
+
+  friend std::ostream& operator<<(std::ostream& os, SlotUnsticky&& manipulator)
+  {
+    manipulator.m_slot = &StreamSlots::slot(os, manipulator.m_index);
+    manipulator.m_saved = *manipulator.m_slot;
+    *manipulator.m_slot = manipulator.m_value;
+    return os;
+  }
+};
+
+// Like utils::iomanip::Object: the object itself is stored in the pword.
+class SlotObject : public SlotUnsticky
+{
+ protected:
+  SlotObject(SlotIndex const& index) : SlotUnsticky(index, 0, this) { }
+
+  static void* ptr(std::ios_base& ios, SlotIndex const& index) { return get_pword_from(ios, index); }
+};
+
+} // namespace slots
+
+//=============================================================================
+// The manipulators of manip_test.cxx, with utils::iomanip and with slots.
+
+// Manipulators of other libraries, so that the xalloc indices of Words and MyObject
+// are not among the first eight.
+utils::iomanip::Index other_indices[8];
+
+class Words : public utils::iomanip::Unsticky<2>
+{
+ private:
+  static utils::iomanip::Index s_index;
+
+ public:
+  Words(long iword, void* pword) : Unsticky(s_index, iword, pword) { }
+
+  static long ivalue(std::ostream& os) { return get_iword_from(os, s_index); }
+  static void* pvalue(std::ostream& os) { return get_pword_from(os, s_index); }
+};
+
+//static
+utils::iomanip::Index Words::s_index;
+
+class MyObject : public utils::iomanip::Object<2>
+{
+ private:
+  static utils::iomanip::Index s_index;
+
+ public:
+  MyObject() : Object(s_index) { }
+
+  static MyObject* ptr(std::ostream& os) { return static_cast<MyObject*>(Object::ptr(os, s_index)); }
+};
+
+//static
+utils::iomanip::Index MyObject::s_index;
+
+class SlotWords : public slots::SlotUnsticky
+{
+ private:
+  static slots::SlotIndex s_index;
+
+ public:
+  SlotWords(long iword, void* pword) : SlotUnsticky(s_index, iword, pword) { }
+
+  static long ivalue(std::ostream& os) { return get_iword_from(os, s_index); }
+  static void* pvalue(std::ostream& os) { return get_pword_from(os, s_index); }
+};
+
+//static
+slots::SlotIndex SlotWords::s_index;
+
+class SlotMyObject : public slots::SlotObject
+{
+ private:
+  static slots::SlotIndex s_index;
+
+ public:
+  SlotMyObject() : SlotObject(s_index) { }
+
+  static SlotMyObject* ptr(std::ostream& os) { return static_cast<SlotMyObject*>(SlotObject::ptr(os, s_index)); }
+};
+
+//static
+slots::SlotIndex SlotMyObject::s_index;
+
+// An object whose operator<< reads the manipulators, like A in manip_test.cxx.
+template<typename WORDS, typename OBJECT>
+struct A
+{
+  long m_iword;
+  bool m_object_used;
+
+  friend std::ostream& operator<<(std::ostream& os, A const& a)
+  {
+    ASSERT(WORDS::ivalue(os) == a.m_iword);
+    ASSERT(!OBJECT::ptr(os) != a.m_object_used);
+    return os << static_cast<char>('a' + WORDS::ivalue(os) % 26);
+  }
+};
+
+// A stream that is destroyed after the thread_local free list of the main thread.
+std::ostringstream static_stream;
+
+template<typename WORDS, typename OBJECT>
+std::string print_manipulated_objects(char const* name, int n)
+{
+  using a_type = A<WORDS, OBJECT>;
+  std::ostringstream ss;
+  ss << a_type{0, false};
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i)
+  {
+    OBJECT object;
+    ss << WORDS(i, nullptr) << a_type{i, false} << std::move(object) << a_type{i, true};
+  }
+  auto end = std::chrono::steady_clock::now();
+  // The values are restored.
+  ss << a_type{0, false};
+  std::cout << name << ": " << std::chrono::duration<double, std::nano>(end - start).count() / n << " ns per manipulated object." << std::endl;
+  return ss.str();
+}
+
+// What the operator<< of an object does to find its manipulators, without the formatting around it.
+template<typename WORDS, typename OBJECT>
+void read_manipulators(char const* name, int n)
+{
+  std::ostringstream ss;
+  ss << WORDS(1, nullptr);
+  long sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i)
+  {
+    sum += WORDS::ivalue(ss) + (OBJECT::ptr(ss) != nullptr);
+    asm volatile ("" : "+r" (sum));
+  }
+  auto end = std::chrono::steady_clock::now();
+  ASSERT(sum == 0);
+  std::cout << name << ": " << std::chrono::duration<double, std::nano>(end - start).count() / n << " ns per lookup of two manipulators." << std::endl;
+}
+
+template<typename WORDS, typename OBJECT>
+void create_streams(char const* name, int n)
+{
+  using a_type = A<WORDS, OBJECT>;
+  size_t const allocations_before = number_of_allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i)
+  {
+    std::ostringstream ss;
+    ss << WORDS(i, nullptr) << a_type{i, false};
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::cout << name << ": " << std::chrono::duration<double, std::nano>(end - start).count() / n << " ns and " <<
+    static_cast<double>(number_of_allocations - allocations_before) / n << " allocations per stream." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The semantics of manip_test.cxx, as far as prototyped (temporary manipulators).
+  {
+    using a_type = A<SlotWords, SlotMyObject>;
+    std::ostringstream ss;
+    ss << a_type{0, false} << SlotWords(1234, nullptr) << a_type{1234, false} << ", " << a_type{1234, false};
+    ss << a_type{0, false} << SlotMyObject() << a_type{0, true} << SlotWords(5678, nullptr) << a_type{5678, true};
+    ss << a_type{0, false};
+    // copyfmt() gives the other stream its own copy of the slots.
+    std::ostringstream ss2;
+    {
+      SlotWords words(42, nullptr);
+      ss << std::move(words);
+      ss2.copyfmt(ss);
+      ASSERT(SlotWords::ivalue(ss2) == 42);
+    }
+    ASSERT(SlotWords::ivalue(ss) == 0);
+    ASSERT(SlotWords::ivalue(ss2) == 42);
+  }
+  // Give static_stream a StreamSlots block; it is deleted directly at program exit.
+  static_stream << SlotWords(1, nullptr) << A<SlotWords, SlotMyObject>{1, false};
+
+  constexpr int n = 10000000;
+  std::string result1 = print_manipulated_objects<Words, MyObject>("utils::iomanip", n);
+  std::string result2 = print_manipulated_objects<SlotWords, SlotMyObject>("slots", n);
+  ASSERT(result1 == result2);
+  read_manipulators<Words, MyObject>("utils::iomanip, lookup", n);
+  read_manipulators<SlotWords, SlotMyObject>("slots, lookup", n);
+
+  constexpr int number_of_streams = 1000000;
+  create_streams<Words, MyObject>("utils::iomanip, new streams", number_of_streams);
+  create_streams<SlotWords, SlotMyObject>("slots, new streams", number_of_streams);
+
+  Dout(dc::notice, "Success");
+}
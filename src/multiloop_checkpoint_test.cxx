@@ -0,0 +1,442 @@
+#include "sys.h"
+#include "debug.h"
+#include "BasicMultiLoop.h"
+#include "MultiLoopTestLoops.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// A MultiLoop whose state can be serialized.
+//
+// The MultiLoop state machine of BasicMultiLoop, with serialize() and deserialize().
+// The binary format is a magic number, followed by the number of loops, the current
+// loop, the finished flag and the counters; all as LEB128 varints (counters zigzag
+// encoded).
+//
+// A state can only be serialized at the top of a loop body (no pending breaks()).
+class ResumableMultiLoop : public BasicMultiLoop<std::vector<int>>
+{
+ private:
+  static constexpr char const magic[4] = { 'M', 'L', 'S', '1' };
+  static constexpr uint64_t max_loops = 1024;          // More is surely a corrupt checkpoint.
+
+  static void put_varint(std::string& out, uint64_t value)
+  {
+    while (value >= 0x80)
+    {
+      out += static_cast<char>(value | 0x80);
+      value >>= 7;
+    }
+    out += static_cast<char>(value);
+  }
+
+  static uint64_t get_varint(std::string_view& in)
+  {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (in.empty())
+        throw std::runtime_error("Truncated MultiLoop checkpoint");
+      uint8_t byte = in.front();
+      in.remove_prefix(1);
+      value |= uint64_t{byte & 0x7fU} << shift;
+      if (!(byte & 0x80))
+        return value;
+    }
+    throw std::runtime_error("Corrupt MultiLoop checkpoint");
+  }
+
+ public:
+  ResumableMultiLoop() : BasicMultiLoop({}, 0) { }
+  ResumableMultiLoop(int n, int b = 0) : BasicMultiLoop(std::vector<int>(n), b) { }
+
+  ResumableMultiLoop const& state() const { return *this; }
+
+  // Append the serialized state to out.
+  void serialize(std::string& out) const
+  {
+    ASSERT(m_breaks == -1);
+    out.append(magic, sizeof(magic));
+    put_varint(out, counters().size());
+    put_varint(out, current_loop());
+    put_varint(out, finished());
+    for (int counter : counters())
+      put_varint(out, (static_cast<uint64_t>(counter) << 1) ^ static_cast<uint64_t>(counter >> 31));
+  }
+
+  // Read a state written by serialize() from the front of in, and remove it from in.
+  static ResumableMultiLoop deserialize(std::string_view& in)
+  {
+    if (in.substr(0, sizeof(magic)) != std::string_view(magic, sizeof(magic)))
+      throw std::runtime_error("Not a MultiLoop checkpoint");
+    in.remove_prefix(sizeof(magic));
+    // Don't let a corrupt checkpoint make us allocate an arbitrary amount of memory: every counter takes at least one byte.
+    uint64_t const number_of_loops = get_varint(in);
+    if (number_of_loops > max_loops || number_of_loops > in.size())
+      throw std::runtime_error("Corrupt MultiLoop checkpoint");
+    std::vector<int> counters(number_of_loops);
+    uint64_t current_loop = get_varint(in);
+    bool finished = get_varint(in);
+    for (int& counter : counters)
+    {
+      uint64_t zigzag = get_varint(in);
+      counter = static_cast<int>((zigzag >> 1) ^ -(zigzag & 1));
+    }
+    if (counters.empty() || current_loop >= counters.size())
+      throw std::runtime_error("Corrupt MultiLoop checkpoint");
+    ResumableMultiLoop ml;
+    ml.set_state(counters, current_loop, finished);
+    return ml;
+  }
+};
+
+// Periodically write checkpoints of a ResumableMultiLoop to a file.
+//
+// A background thread sets a flag every period; the enumeration calls poll()
+// at the top of its loop body, which costs a single relaxed load as long as
+// no checkpoint is requested. When one is, poll() serializes the loop state
+// (plus caller supplied progress data) into a small buffer and hands it to the
+// background thread, which writes it to a temporary file, fsyncs it and renames
+// that over the checkpoint file, so a crash never leaves a half written checkpoint.
+// If any step fails the previous checkpoint is kept.
+class Checkpointer
+{
+ private:
+  std::string m_filename;
+  std::chrono::steady_clock::duration m_period;
+  std::atomic<bool> m_requested{false};
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::string m_pending;                        // Checkpoint that still has to be written; protected by m_mutex.
+  bool m_writing = false;                       // Protected by m_mutex.
+  bool m_stop = false;                          // Protected by m_mutex.
+  int m_failures = 0;                           // Number of checkpoints that could not be written; protected by m_mutex.
+  std::thread m_writer;
+
+  // Write data to a temporary file, fsync it, rename it over the checkpoint file and fsync the directory.
+  // On any error the temporary file is removed and the previous checkpoint is left in place.
+  bool write(std::string const& data)
+  {
+    std::string const tmp = m_filename + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+      Dout(dc::warning, "open(\"" << tmp << "\"): " << std::strerror(errno));
+      return false;
+    }
+    bool success = true;
+    for (size_t written = 0; success && written < data.size();)
+    {
+      ssize_t len = ::write(fd, data.data() + written, data.size() - written);
+      if (len == -1 && errno == EINTR)
+        continue;
+      success = len > 0;
+      if (success)
+        written += len;
+      else
+        Dout(dc::warning, "write(\"" << tmp << "\"): " << (len == -1 ? std::strerror(errno) : "no progress"));
+    }
+    if (success && ::fsync(fd) == -1)
+    {
+      Dout(dc::warning, "fsync(\"" << tmp << "\"): " << std::strerror(errno));
+      success = false;
+    }
+    if (::close(fd) == -1 && success)
+    {
+      Dout(dc::warning, "close(\"" << tmp << "\"): " << std::strerror(errno));
+      success = false;
+    }
+    if (success && std::rename(tmp.c_str(), m_filename.c_str()) == -1)
+    {
+      Dout(dc::warning, "rename(\"" << tmp << "\", \"" << m_filename << "\"): " << std::strerror(errno));
+      success = false;
+    }
+    if (!success)
+    {
+      ::unlink(tmp.c_str());
+      return false;
+    }
+    // Make the rename itself durable.
+    std::filesystem::path directory = std::filesystem::path(m_filename).parent_path();
+    int dir_fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1 || ::fsync(dir_fd) == -1)
+    {
+      Dout(dc::warning, "fsync(\"" << directory << "\"): " << std::strerror(errno));
+      success = false;
+    }
+    if (dir_fd != -1)
+      ::close(dir_fd);
+    return success;
+  }
+
+  void writer()
+  {
+    auto have_work = [this]{ return m_stop || !m_pending.empty(); };
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop)
+    {
+      // Let a period pass since the last checkpoint (unless one was taken after request()), then ask for the next one.
+      if (m_period.count() > 0 && !m_cv.wait_for(lock, m_period, have_work))
+        m_requested.store(true, std::memory_order_relaxed);
+      m_cv.wait(lock, have_work);
+      if (!m_pending.empty())
+      {
+        std::string data = std::move(m_pending);
+        m_pending.clear();
+        m_writing = true;
+        lock.unlock();
+        bool success = write(data);
+        lock.lock();
+        m_writing = false;
+        if (!success)
+          ++m_failures;
+      }
+    }
+  }
+
+ public:
+  // A period of zero means that checkpoints are only taken after calling request().
+  Checkpointer(std::string filename, std::chrono::steady_clock::duration period) :
+    m_filename(std::move(filename)), m_period(period), m_writer(&Checkpointer::writer, this) { }
+
+  ~Checkpointer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_one();
+    m_writer.join();
+  }
+
+  void request() { m_requested.store(true, std::memory_order_relaxed); }
+
+  // Call at the top of the loop body. Returns true if a checkpoint was taken.
+  bool poll(ResumableMultiLoop const& ml, std::string_view progress)
+  {
+    if (!m_requested.load(std::memory_order_relaxed))
+      return false;
+    m_requested.store(false, std::memory_order_relaxed);
+    std::string data;
+    data.reserve(64 + progress.size());
+    ml.serialize(data);
+    data.append(progress);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending = std::move(data);
+    }
+    m_cv.notify_one();
+    return true;
+  }
+
+  // Wait until all taken checkpoints were written.
+  void flush()
+  {
+    for (;;)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pending.empty() && !m_writing)
+          break;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // The number of checkpoints that could not be written.
+  int failures()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failures;
+  }
+
+  // Read the last checkpoint; returns false if there is none.
+  static bool load(std::string const& filename, ResumableMultiLoop& ml, std::string& progress)
+  {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+      return false;
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string_view in(data);
+    ml = ResumableMultiLoop::deserialize(in);
+    progress = in;
+    return true;
+  }
+};
+
+struct Killed { };
+
+// Writes the output of multiloop_test.cxx, and requests a checkpoint or kills the job at the given iteration.
+struct CheckpointVisitor : DigestVisitor
+{
+  Checkpointer& m_checkpointer;
+  int m_checkpoint_at;
+  int m_kill_at;
+  int m_iteration = 0;
+
+  void top(ResumableMultiLoop const& ml)
+  {
+    if (m_iteration == m_checkpoint_at)
+      m_checkpointer.request();
+    if (m_iteration++ == m_kill_at)
+      throw Killed();
+    m_checkpointer.poll(ml, m_out);
+  }
+};
+
+// The enumeration of multiloop_test.cxx; the output so far is the progress data.
+// Throws Killed after kill_at iterations of the loop body (if kill_at >= 0).
+void run(ResumableMultiLoop& ml, std::string& out, Checkpointer& checkpointer, int checkpoint_at, int kill_at)
+{
+  CheckpointVisitor visitor{{out}, checkpointer, checkpoint_at, kill_at};
+  multiloop_body(ml, visitor);
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  std::string const filename = "multiloop_checkpoint.bin";
+
+  // Get the expected output from an uninterrupted run.
+  std::string digest;
+  {
+    Checkpointer checkpointer(filename, {});
+    ResumableMultiLoop ml(4);
+    run(ml, digest, checkpointer, -1, -1);
+  }
+  ASSERT(digest == multiloop_digest());
+
+  // Take a checkpoint at every iteration of the loop body, kill the job 13 iterations later, and resume it from the checkpoint file.
+  int resumed = 0;
+  for (int checkpoint_at = 0; checkpoint_at < 200; ++checkpoint_at)
+  {
+    std::remove(filename.c_str());
+    std::string out;
+    {
+      Checkpointer checkpointer(filename, {});
+      ResumableMultiLoop ml(4);
+      try
+      {
+        run(ml, out, checkpointer, checkpoint_at, checkpoint_at + 13);
+      }
+      catch (Killed const&)
+      {
+      }
+      checkpointer.flush();
+    }
+    ResumableMultiLoop ml;
+    std::string progress;
+    if (!Checkpointer::load(filename, ml, progress))
+      continue;                                 // Finished before the checkpoint.
+    Checkpointer checkpointer(filename, {});
+    run(ml, progress, checkpointer, -1, -1);
+    ASSERT(progress == digest);
+    ++resumed;
+  }
+  std::remove(filename.c_str());
+  Dout(dc::notice, "Resumed " << resumed << " killed jobs.");
+
+  // A corrupt or truncated checkpoint is rejected, without allocating what it claims.
+  {
+    std::string data;
+    ResumableMultiLoop(4).serialize(data);
+    std::string huge = data.substr(0, 4) + "\x80\x80\x80\x80\x80\x80\x80\x80\x01";     // 2^56 loops.
+    for (std::string const& corrupt : { huge, data.substr(0, data.size() - 1), data.substr(0, 5) })
+    {
+      std::string_view in(corrupt);
+      bool rejected = false;
+      try
+      {
+        ResumableMultiLoop::deserialize(in);
+      }
+      catch (std::runtime_error const&)
+      {
+        rejected = true;
+      }
+      ASSERT(rejected);
+    }
+    std::string_view in(data);
+    ASSERT(ResumableMultiLoop::deserialize(in).number_of_loops() == 4 && in.empty());
+  }
+
+  // A failed write keeps the previous checkpoint.
+  {
+    std::string const tmp = filename + ".tmp";
+    Checkpointer checkpointer(filename, {});
+    ResumableMultiLoop ml(4);
+    checkpointer.request();
+    checkpointer.poll(ml, "good");
+    checkpointer.flush();
+    std::filesystem::create_directory(tmp);     // Make open() of the temporary file fail.
+    ml.start_next_loop_at(0);
+    checkpointer.request();
+    checkpointer.poll(ml, "lost");
+    checkpointer.flush();
+    std::filesystem::remove(tmp);
+    ASSERT(checkpointer.failures() == 1);
+    ResumableMultiLoop loaded;
+    std::string progress;
+    bool success = Checkpointer::load(filename, loaded, progress);
+    ASSERT(success && progress == "good" && loaded.current_loop() == 0);
+  }
+  std::remove(filename.c_str());
+
+  // With a period, a checkpoint is taken once per period; not every time that poll() is called.
+  {
+    using namespace std::chrono_literals;
+    constexpr int periods = 10;
+    auto const period = 20ms;
+    Checkpointer checkpointer(filename, period);
+    ResumableMultiLoop ml(4);
+    int taken = 0;
+    long polls = 0;
+    auto const end = std::chrono::steady_clock::now() + periods * period;
+    while (std::chrono::steady_clock::now() < end)
+    {
+      taken += checkpointer.poll(ml, "progress");
+      ++polls;
+    }
+    checkpointer.flush();
+    Dout(dc::notice, "Took " << taken << " checkpoints in " << periods << " periods (" << polls << " calls to poll()).");
+    ASSERT(1 <= taken && taken <= periods);
+    ASSERT(checkpointer.failures() == 0);
+  }
+  std::remove(filename.c_str());
+
+  // The cost of taking a checkpoint in the inner loop.
+  {
+    Checkpointer checkpointer(filename, {});
+    ResumableMultiLoop ml(10);
+    std::string progress(256, 'x');
+    constexpr int count = 10000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i)
+    {
+      checkpointer.request();
+      checkpointer.poll(ml, progress);
+    }
+    auto end = std::chrono::steady_clock::now();
+    checkpointer.flush();
+    std::cout << "Taking a checkpoint stops the loop for " << std::chrono::duration<double, std::nano>(end - start).count() / count << " ns." << std::endl;
+  }
+  std::remove(filename.c_str());
+
+  std::cout << "Finished" << std::endl;
+}
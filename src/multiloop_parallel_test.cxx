@@ -0,0 +1,220 @@
+#include "sys.h"
+#include "debug.h"
+#include "utils/MultiLoop.h"
+#include "BasicMultiLoop.h"
+#include "MultiLoopTestLoops.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A minimal work-stealing thread pool.
+//
+// The workers are started once and wait for the next call to run(). Every worker
+// owns a deque of task indices; it pops tasks from the front of its own deque and,
+// when that is empty, steals from the back of the others.
+class WorkStealingPool
+{
+ private:
+  struct Queue
+  {
+    std::mutex m_mutex;
+    std::deque<int> m_tasks;
+  };
+
+  int m_number_of_workers;
+  std::deque<Queue> m_queues;
+  std::function<void(int)> const* m_task = nullptr;     // The task of the current run(); published through the queue mutexes.
+  std::atomic<int> m_remaining{0};                      // The number of tasks of the current run() that didn't finish yet.
+  std::mutex m_mutex;
+  std::condition_variable m_start_cv;
+  std::condition_variable m_done_cv;
+  unsigned int m_generation = 0;                        // Incremented by every run(); protected by m_mutex.
+  bool m_stop = false;                                  // Protected by m_mutex.
+  std::vector<std::thread> m_workers;
+
+  static bool pop_front(Queue& queue, int& task)
+  {
+    std::lock_guard<std::mutex> lock(queue.m_mutex);
+    if (queue.m_tasks.empty())
+      return false;
+    task = queue.m_tasks.front();
+    queue.m_tasks.pop_front();
+    return true;
+  }
+
+  static bool pop_back(Queue& queue, int& task)
+  {
+    std::lock_guard<std::mutex> lock(queue.m_mutex);
+    if (queue.m_tasks.empty())
+      return false;
+    task = queue.m_tasks.back();
+    queue.m_tasks.pop_back();
+    return true;
+  }
+
+  void worker(int w)
+  {
+    unsigned int generation = 0;
+    for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_start_cv.wait(lock, [&]{ return m_stop || m_generation != generation; });
+        if (m_stop)
+          return;
+        generation = m_generation;
+      }
+      int t;
+      for (;;)
+      {
+        bool found = pop_front(m_queues[w], t);
+        // Our own queue is empty; try to steal. No new tasks are added during a run, so when all queues are empty we're done.
+        for (int victim = (w + 1) % m_number_of_workers; victim != w && !found; victim = (victim + 1) % m_number_of_workers)
+          found = pop_back(m_queues[victim], t);
+        if (!found)
+          break;
+        (*m_task)(t);
+        if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_done_cv.notify_all();
+        }
+      }
+    }
+  }
+
+ public:
+  WorkStealingPool(int number_of_workers = std::max(2U, std::thread::hardware_concurrency())) :
+    m_number_of_workers(number_of_workers), m_queues(number_of_workers)
+  {
+    for (int w = 0; w < m_number_of_workers; ++w)
+      m_workers.emplace_back(&WorkStealingPool::worker, this, w);
+  }
+
+  ~WorkStealingPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_start_cv.notify_all();
+    for (std::thread& worker : m_workers)
+      worker.join();
+  }
+
+  // Call task(i) for every i in [0, number_of_tasks>, in parallel. Returns when all tasks finished.
+  void run(int number_of_tasks, std::function<void(int)> const& task)
+  {
+    if (number_of_tasks == 0)
+      return;
+    m_task = &task;
+    m_remaining.store(number_of_tasks, std::memory_order_relaxed);
+    for (int i = 0; i < number_of_tasks; ++i)
+    {
+      Queue& queue = m_queues[i % m_number_of_workers];
+      std::lock_guard<std::mutex> lock(queue.m_mutex);
+      queue.m_tasks.push_back(i);
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    ++m_generation;
+    m_start_cv.notify_all();
+    m_done_cv.wait(lock, [this]{ return m_remaining.load(std::memory_order_acquire) == 0; });
+  }
+};
+
+// Run the iterations [begin, end> of the loop at depth, for the given counters of the loops
+// outside of it, split into slices of slice_size iterations that are run in parallel.
+// Each slice runs body(ml, out) with its own MultiLoopSlice and output string; the outputs
+// are concatenated in order, up to and including the slice that broke out of the loop.
+template<typename BODY>
+std::string run_split(WorkStealingPool& pool, int number_of_loops, int depth, std::vector<int> const& prefix,
+    int begin, int end, int slice_size, BODY const& body)
+{
+  int const number_of_slices = std::max(0, (end - begin + slice_size - 1) / slice_size);
+  std::vector<std::string> results(number_of_slices);
+  std::vector<char> broke_out(number_of_slices);
+  pool.run(number_of_slices, [&](int slice){
+    int const slice_begin = begin + slice * slice_size;
+    MultiLoopSlice ml(number_of_loops, depth, prefix, slice_begin, std::min(end, slice_begin + slice_size));
+    body(ml, results[slice]);
+    broke_out[slice] = ml.broke_out();
+  });
+  std::string merged;
+  for (int slice = 0; slice < number_of_slices; ++slice)
+  {
+    merged += results[slice];
+    if (broke_out[slice])
+      break;
+  }
+  return merged;
+}
+
+// The body of multiloop_test.cxx, for any MultiLoop type, writing its output to out.
+template<typename ML>
+void run_body(ML& ml, std::string& out)
+{
+  DigestVisitor visitor{out};
+  multiloop_body(ml, visitor);
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  std::string const digest = multiloop_digest();
+
+  // The serial run, with the same body.
+  {
+    MultiLoop ml(4);
+    std::string serial;
+    run_body(ml, serial);
+    ASSERT(serial == digest);
+  }
+
+  WorkStealingPool pool;
+
+  // Split the outer most loop (depth 0) in slices of different sizes; merging the results in order must give the same output.
+  for (int slice_size = 1; slice_size <= 14; ++slice_size)
+  {
+    std::string merged = run_split(pool, 4, 0, {}, 0, 14, slice_size, run_body<MultiLoopSlice>);
+    ASSERT(merged == digest);
+    Dout(dc::notice, "depth 0, slice_size " << slice_size << ": OK");
+  }
+
+  // Split loop 1, for every value of i0. Loop 1 is broken out of (i1 % 5 == 0, or i2 == 7 in loop 2).
+  for (int slice_size = 1; slice_size <= 4; ++slice_size)
+  {
+    for (int i0 = 0; i0 < 14; ++i0)
+    {
+      std::string expected;
+      DigestVisitor visitor{expected};
+      multiloop_for_loops_inside(visitor, i0);
+      std::string merged = run_split(pool, 4, 1, { i0 }, i0, 12, slice_size, run_body<MultiLoopSlice>);
+      ASSERT(merged == expected);
+    }
+    Dout(dc::notice, "depth 1, slice_size " << slice_size << ": OK");
+  }
+
+  // The cost of a run() of the pool, with as many empty tasks as there are workers.
+  {
+    constexpr int runs = 10000;
+    int const number_of_tasks = std::max(2U, std::thread::hardware_concurrency());
+    std::atomic<int> executed{0};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+      pool.run(number_of_tasks, [&](int){ executed.fetch_add(1, std::memory_order_relaxed); });
+    auto end = std::chrono::steady_clock::now();
+    ASSERT(executed == runs * number_of_tasks);
+    std::cout << "WorkStealingPool::run: " << std::chrono::duration<double, std::micro>(end - start).count() / runs << " us per run." << std::endl;
+  }
+
+  std::cout << "Finished" << std::endl;
+}
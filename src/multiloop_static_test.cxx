@@ -0,0 +1,109 @@
+#include "sys.h"
+#include "debug.h"
+#include "utils/MultiLoop.h"
+#include "BasicMultiLoop.h"
+#include "MultiLoopTestLoops.h"
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// MultiLoop with a compile-time number of loops.
+//
+// Has the same interface as MultiLoop, but the loop counters are stored in
+// a std::array<int, N> and the number of loops is a constant, so that the
+// compiler can keep the state in registers and fold inner_loop().
+template<int N>
+class StaticMultiLoop : public BasicMultiLoop<std::array<int, N>>
+{
+  static_assert(N > 0, "Need at least one loop.");
+
+ public:
+  using state_type = StaticMultiLoop;
+
+  StaticMultiLoop(int b = 0) : BasicMultiLoop<std::array<int, N>>({}, b) { }
+
+  state_type const& state() const { return *this; }
+};
+
+// The body of multiloop_test.cxx, for any MultiLoop type.
+template<typename ML, typename STATE>
+void run_test(ML& ml, STATE const& state, std::string& output)
+{
+  ml = state;
+  DigestVisitor visitor{output};
+  multiloop_body(ml, visitor);
+}
+
+// The same loops, but only summing the counters (to measure the loop overhead).
+template<typename ML>
+[[gnu::noipa]] long checksum_multiloop(ML ml)
+{
+  ChecksumVisitor visitor;
+  multiloop_body(ml, visitor);
+  return visitor.m_sum;
+}
+
+// The same, hand-written with nested for loops.
+[[gnu::noipa]] long checksum_for_loops()
+{
+  ChecksumVisitor visitor;
+  multiloop_for_loops(visitor);
+  return visitor.m_sum;
+}
+
+template<typename F>
+double measure(char const* name, F f, long expected)
+{
+  constexpr int repeat = 1000000;
+  long sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; ++i)
+    sum += f();
+  auto end = std::chrono::steady_clock::now();
+  ASSERT(sum == repeat * expected);
+  double ns = std::chrono::duration<double, std::nano>(end - start).count() / repeat;
+  std::cout << name << ": " << ns << " ns per run." << std::endl;
+  return ns;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  std::string const digest = multiloop_digest();
+
+  // The dynamic MultiLoop.
+  {
+    MultiLoop ml;
+    MultiLoopState state;
+    {
+      MultiLoop ml2(4);
+      state = ml2.state();
+    }
+    std::string output;
+    run_test(ml, state, output);
+    ASSERT(output == digest);
+  }
+
+  // The compile-time MultiLoop, using the exact same run_test.
+  {
+    StaticMultiLoop<4> ml;
+    StaticMultiLoop<4>::state_type state;
+    {
+      StaticMultiLoop<4> ml2;
+      state = ml2.state();
+    }
+    std::string output;
+    run_test(ml, state, output);
+    ASSERT(output == digest);
+  }
+
+  // Benchmark.
+  long const expected = checksum_for_loops();
+  measure("for loops", [](){ return checksum_for_loops(); }, expected);
+  measure("MultiLoop", [](){ MultiLoop ml(4); return checksum_multiloop(ml); }, expected);
+  measure("StaticMultiLoop<4>", [](){ StaticMultiLoop<4> ml; return checksum_multiloop(ml); }, expected);
+
+  std::cout << "Finished" << std::endl;
+}
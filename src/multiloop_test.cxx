@@ -1,6 +1,7 @@
 #include "sys.h"
 #include "debug.h"
 #include "utils/MultiLoop.h"
+#include "MultiLoopTestLoops.h"
 #include <iostream>
 #include <exception>
 
@@ -37,40 +38,7 @@ int main()
 {
   Debug(NAMESPACE_DEBUG::init());
 
-  for (int i0 = 0; i0 < 14; ++i0)
-  {
-    digest += std::to_string(i0) + ',';
-    for (int i1 = i0; i1 < 12; ++i1)
-    {
-      if (i1 % 5 == 0)
-        break;
-      digest += std::to_string(i1) + ',';
-      for (int i2 = i1; i2 < 10; ++i2)
-      {
-        if (i2 == 7)
-        {
-          i1 = 100;     // break out of two loops.
-          break;
-        }
-        digest += std::to_string(i2) + ',';
-        for (int i3 = i2; i3 < 8; ++i3)
-        {
-          if (i3 % 3 == 1)
-            continue;
-          digest += std::to_string(i3) + ',';
-          if (i3 % 5 == 1)
-            continue;
-          if (i3 % 7 == 1)
-            break;
-          digest += "E3,";
-        }
-        digest += "e2,";
-      }
-      if (i1 != 100)
-        digest += "e1,";
-    }
-    digest += "e0,";
-  }
+  digest = multiloop_digest();
 
   // Try using a pre-existing, default constructed, MultiLoop.
   MultiLoop ml;
@@ -84,6 +52,14 @@ int main()
   std::cout << "Finished" << std::endl;
 }
 
+// Passes the output of the loops to expect().
+struct ExpectVisitor
+{
+  void counter(int c) { expect(std::to_string(c) + ','); }
+  void inner_end() { expect("E3,"); }
+  void loop_end(int loop) { expect("e" + std::to_string(loop) + ","); }
+};
+
 void run_test(MultiLoop& ml, MultiLoopState const& state)
 {
   // Initialize the MultiLoop with an internal state.
@@ -91,57 +67,9 @@ void run_test(MultiLoop& ml, MultiLoopState const& state)
   {
     try
     {
-      for (ml = state; !ml.finished(); ml.next_loop()) // Have 4 for loops inside eachother.
-      {
-        // *ml : loop number, in the range [0, 4].
-        // ml(): value of the current loop counter.
-        while (ml() < 14 - 2 * (int)*ml)
-        {
-          if (*ml == 1 && ml() % 5 == 0)
-          {
-            ml.breaks(1);
-            break;
-          }
-          if (*ml == 2 && ml() == 7)
-          {
-            ml.breaks(2);
-            break;
-          }
-          if (!ml.inner_loop())
-            expect(std::to_string(ml()) + ',');
-          else
-          {
-            // Inner loop starts here.
-            if (ml() % 3 == 1)
-            {
-              ml.breaks(0);
-              break;
-            }
-            expect(std::to_string(ml()) + ',');
-            if (ml() % 5 == 1)
-            {
-              ml.breaks(0);
-              break;
-            }
-            if (ml() % 7 == 1)
-            {
-              ml.breaks(1);
-              break;
-            }
-            // And ends here.
-            expect("E3,");
-          }
-          // Mandatory line. The value passed is the starting value of the next loop
-          // unless this is the inner loop, in which case the value is ignored.
-          ml.start_next_loop_at(ml());
-        }
-        int loop = ml.end_of_loop();
-        if (loop >= 0)
-        {
-          // Other loops end here.
-          expect("e" + std::to_string(loop) + ",");
-        }
-      }
+      ml = state;
+      ExpectVisitor visitor;
+      multiloop_body(ml, visitor);      // The loops, see MultiLoopTestLoops.h.
     }
     catch (std::exception const&)
     {
@@ -0,0 +1,223 @@
+#include "sys.h"
+#include "utils/ObjectTracker.h"
+#include "debug.h"
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A handle to a HandleTrackedObject: a slot index plus the generation of that slot.
+struct ObjectHandle
+{
+  uint32_t m_slot;
+  uint32_t m_generation;
+};
+
+// The slot table of all HandleTrackedObject<T> objects.
+//
+// A slot contains a pointer to the object that currently occupies it and a
+// generation counter that is incremented every time the slot is freed. A handle
+// is valid as long as its generation matches that of its slot; freed slots are
+// reused. There is no shared ownership and there are no atomics: the table is
+// meant for objects that are created, moved, destroyed and resolved by one thread
+// (or under the same lock).
+template<typename T>
+class SlotTable
+{
+ private:
+  struct Slot
+  {
+    T* m_object;
+    uint32_t m_generation;
+    uint32_t m_next_free;                       // Only valid while the slot is free.
+  };
+
+  static constexpr uint32_t none = ~uint32_t{0};
+
+  std::vector<Slot> m_slots;
+  uint32_t m_free_head = none;
+
+ public:
+  static SlotTable& instance()
+  {
+    static SlotTable s_instance;
+    return s_instance;
+  }
+
+  ObjectHandle acquire(T* object)
+  {
+    uint32_t slot = m_free_head;
+    if (slot == none)
+    {
+      slot = m_slots.size();
+      m_slots.push_back({ nullptr, 0, none });
+    }
+    else
+      m_free_head = m_slots[slot].m_next_free;
+    m_slots[slot].m_object = object;
+    return { slot, m_slots[slot].m_generation };
+  }
+
+  void release(uint32_t slot)
+  {
+    Slot& s = m_slots[slot];
+    s.m_object = nullptr;
+    ++s.m_generation;                           // Invalidate all existing handles.
+    s.m_next_free = m_free_head;
+    m_free_head = slot;
+  }
+
+  void move(uint32_t slot, T* object) { m_slots[slot].m_object = object; }
+
+  // Returns the object, or nullptr if it was destroyed.
+  T* resolve(ObjectHandle handle) const
+  {
+    Slot const& slot = m_slots[handle.m_slot];
+    return slot.m_generation == handle.m_generation ? slot.m_object : nullptr;
+  }
+};
+
+// Base class of objects that can be tracked with an ObjectHandle.
+//
+// Moving the object moves its slot along (so handles keep pointing to the moved
+// object); a moved-from object gets a new slot only when a handle is requested.
+template<typename T>
+class HandleTrackedObject
+{
+ private:
+  static constexpr uint32_t no_slot = ~uint32_t{0};
+  mutable ObjectHandle m_handle;
+
+  static SlotTable<T>& table() { return SlotTable<T>::instance(); }
+  T* self() const { return const_cast<T*>(static_cast<T const*>(this)); }
+
+ protected:
+  HandleTrackedObject() : m_handle(table().acquire(self())) { }
+
+  HandleTrackedObject(HandleTrackedObject&& orig) : m_handle(orig.m_handle)
+  {
+    orig.m_handle.m_slot = no_slot;
+    if (m_handle.m_slot != no_slot)
+      table().move(m_handle.m_slot, self());
+  }
+
+  ~HandleTrackedObject()
+  {
+    if (m_handle.m_slot != no_slot)
+      table().release(m_handle.m_slot);
+  }
+
+ public:
+  ObjectHandle handle() const
+  {
+    if (m_handle.m_slot == no_slot)
+      m_handle = table().acquire(self());
+    return m_handle;
+  }
+
+  static T* resolve(ObjectHandle handle) { return table().resolve(handle); }
+};
+
+//=============================================================================
+// The original, as in object_tracker_test.cxx.
+
+struct Node;
+
+class NodeTracker : public utils::ObjectTracker<Node>
+{
+ public:
+  NodeTracker(utils::Badge<utils::TrackedObject<NodeTracker>>, Node* tracked) : utils::ObjectTracker<Node>(tracked) { }
+};
+
+class Node : public utils::TrackedObject<NodeTracker>
+{
+ private:
+  std::string s_;
+
+ public:
+  Node(std::string const& s) : s_(s) { }
+
+  std::string const& s() const { return s_; }
+};
+
+//=============================================================================
+// The same, using a handle.
+
+class HandleNode : public HandleTrackedObject<HandleNode>
+{
+ private:
+  std::string s_;
+
+ public:
+  HandleNode(std::string const& s) : s_(s) { }
+
+  std::string const& s() const { return s_; }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The same test as object_tracker_test.cxx.
+  ObjectHandle handle2;
+  {
+    HandleNode node("This is a long string so that it won't be put inside the std::string.");
+    ObjectHandle handle = node.handle();
+    HandleNode node2(std::move(node));
+    ASSERT(node.s().empty());
+    std::cout << "tracked.s = " << HandleNode::resolve(handle)->s() << std::endl;
+    ASSERT(HandleNode::resolve(handle) == &node2);
+    // The moved-from object gets a new slot.
+    ObjectHandle handle0 = node.handle();
+    ASSERT(handle0.m_slot != handle.m_slot && HandleNode::resolve(handle0) == &node);
+    handle2 = handle;
+  }
+  // Destroyed objects can not be resolved anymore, also not after their slot was reused.
+  ASSERT(HandleNode::resolve(handle2) == nullptr);
+  HandleNode node3("reuses a slot");
+  ASSERT(HandleNode::resolve(handle2) == nullptr);
+  ASSERT(HandleNode::resolve(node3.handle()) == &node3);
+
+  // Benchmark resolving where a moved object is now.
+  constexpr int number_of_nodes = 1000;
+  constexpr int rounds = 10000;
+  std::vector<Node> nodes;
+  std::vector<HandleNode> handle_nodes;
+  nodes.reserve(number_of_nodes);
+  handle_nodes.reserve(number_of_nodes);
+  std::vector<std::weak_ptr<NodeTracker>> trackers;
+  std::vector<ObjectHandle> handles;
+  for (int i = 0; i < number_of_nodes; ++i)
+  {
+    Node node(std::to_string(i));
+    trackers.push_back(node);
+    nodes.push_back(std::move(node));
+    HandleNode handle_node(std::to_string(i));
+    handles.push_back(handle_node.handle());
+    handle_nodes.push_back(std::move(handle_node));
+  }
+
+  size_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; ++r)
+    for (auto const& tracker : trackers)
+      sum += tracker.lock()->tracked_object().s().size();
+  asm volatile ("" :: "r" (sum));
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "std::weak_ptr<NodeTracker>::lock(): " << std::chrono::duration<double, std::nano>(end - start).count() / (rounds * number_of_nodes) << " ns per resolve." << std::endl;
+
+  size_t handle_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; ++r)
+    for (ObjectHandle handle : handles)
+      handle_sum += HandleNode::resolve(handle)->s().size();
+  asm volatile ("" :: "r" (handle_sum));
+  end = std::chrono::steady_clock::now();
+  std::cout << "HandleNode::resolve(): " << std::chrono::duration<double, std::nano>(end - start).count() / (rounds * number_of_nodes) << " ns per resolve." << std::endl;
+  ASSERT(sum == handle_sum);
+
+  Dout(dc::notice, "Success");
+}
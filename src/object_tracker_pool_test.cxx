@@ -0,0 +1,343 @@
+#include "sys.h"
+#include "utils/ObjectTracker.h"
+#include "debug.h"
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A pool of fixed size blocks; one free list per size class and thread.
+//
+// Blocks are carved out of chunks of blocks_per_chunk blocks that are never
+// returned to the system: the chunks are owned by a process-wide store that is
+// intentionally leaked, because blocks can still be in use (or sit on the free
+// list of another thread) when the thread that allocated them exits. A block freed
+// by another thread than the one that allocated it simply ends up on the free list
+// of that thread. When a thread exits, its free list is handed over to the global
+// free list, from which threads refill their own list before a new chunk is made.
+// Blocks that are allocated or freed by a thread after its free list was destroyed
+// (for example by the destructor of another thread_local) go to and come from the
+// global free list directly.
+template<size_t block_size>
+class SizeClassPool
+{
+ private:
+  static constexpr size_t blocks_per_chunk = 256;
+
+  union Block
+  {
+    Block* m_next;
+    alignas(std::max_align_t) char m_data[block_size];
+  };
+
+  struct Global
+  {
+    std::mutex m_mutex;
+    Block* m_head = nullptr;                            // Blocks of threads that exited.
+    std::vector<std::unique_ptr<Block[]>> m_chunks;
+  };
+
+  static Global& global()
+  {
+    static Global* s_global = new Global;               // Never destroyed.
+    return *s_global;
+  }
+
+  struct FreeList
+  {
+    Block* m_head = nullptr;
+
+    ~FreeList()
+    {
+      t_free_list_destroyed = true;
+      if (!m_head)
+        return;
+      Block* tail = m_head;
+      while (tail->m_next)
+        tail = tail->m_next;
+      Global& store = global();
+      std::lock_guard<std::mutex> lock(store.m_mutex);
+      tail->m_next = store.m_head;
+      store.m_head = std::exchange(m_head, nullptr);
+    }
+  };
+
+  static FreeList& free_list()
+  {
+    static thread_local FreeList s_free_list;
+    return s_free_list;
+  }
+  // Set when the free list of this thread was destroyed. Being trivially destructible,
+  // this flag itself can still be read after that.
+  static thread_local bool t_free_list_destroyed;
+
+  // Returns a new chunk, linked as a list of blocks. The caller must hold the lock of store.
+  static Block* new_chunk(Global& store)
+  {
+    store.m_chunks.emplace_back(new Block[blocks_per_chunk]);
+    Block* chunk = store.m_chunks.back().get();
+    for (size_t i = 0; i < blocks_per_chunk - 1; ++i)
+      chunk[i].m_next = &chunk[i + 1];
+    chunk[blocks_per_chunk - 1].m_next = nullptr;
+    return chunk;
+  }
+
+  static Block* refill()
+  {
+    Global& store = global();
+    std::lock_guard<std::mutex> lock(store.m_mutex);
+    if (store.m_head)
+      return std::exchange(store.m_head, nullptr);
+    return new_chunk(store);
+  }
+
+ public:
+  static void* allocate()
+  {
+    if (t_free_list_destroyed)
+    {
+      Global& store = global();
+      std::lock_guard<std::mutex> lock(store.m_mutex);
+      if (!store.m_head)
+        store.m_head = new_chunk(store);
+      return std::exchange(store.m_head, store.m_head->m_next);
+    }
+    FreeList& list = free_list();
+    if (!list.m_head)
+      list.m_head = refill();
+    Block* block = list.m_head;
+    list.m_head = block->m_next;
+    return block;
+  }
+
+  static void deallocate(void* ptr)
+  {
+    Block* block = static_cast<Block*>(ptr);
+    if (t_free_list_destroyed)
+    {
+      Global& store = global();
+      std::lock_guard<std::mutex> lock(store.m_mutex);
+      block->m_next = store.m_head;
+      store.m_head = block;
+      return;
+    }
+    FreeList& list = free_list();
+    block->m_next = list.m_head;
+    list.m_head = block;
+  }
+};
+
+//static
+template<size_t block_size>
+thread_local bool SizeClassPool<block_size>::t_free_list_destroyed;
+
+// A minimal allocator that takes single objects from the SizeClassPool of their size (rounded up to 16 bytes).
+template<typename T>
+struct PoolAllocator
+{
+  using value_type = T;
+  static constexpr size_t size_class = (sizeof(T) + 15) & ~size_t{15};
+
+  PoolAllocator() = default;
+  template<typename U> PoolAllocator(PoolAllocator<U> const&) { }
+
+  T* allocate(size_t n)
+  {
+    if (n == 1)
+      return static_cast<T*>(SizeClassPool<size_class>::allocate());
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, size_t n)
+  {
+    if (n == 1)
+      SizeClassPool<size_class>::deallocate(ptr);
+    else
+      ::operator delete(ptr);
+  }
+
+  template<typename U> bool operator==(PoolAllocator<U> const&) const { return true; }
+};
+
+// The tracker of a PooledTrackedObject.
+template<typename T>
+class PooledObjectTracker
+{
+ private:
+  T* m_tracked;
+
+ public:
+  using tracked_type = T;
+
+  PooledObjectTracker(T* tracked) : m_tracked(tracked) { }
+
+  void set_tracked_object(T* tracked) { m_tracked = tracked; }
+  T const& tracked_object() const { return *m_tracked; }
+  T& tracked_object() { return *m_tracked; }
+};
+
+// Like utils::TrackedObject, but the tracker (and its shared_ptr control block) is
+// allocated with std::allocate_shared from a SizeClassPool, with a single allocation.
+// A moved-from object gets a new tracker only when one is requested.
+template<typename Tracker>
+class PooledTrackedObject
+{
+ private:
+  using tracked_type = typename Tracker::tracked_type;
+  mutable std::shared_ptr<Tracker> m_tracker;
+
+  std::shared_ptr<Tracker> const& tracker() const
+  {
+    if (!m_tracker)
+      m_tracker = std::allocate_shared<Tracker>(PoolAllocator<Tracker>{}, const_cast<tracked_type*>(static_cast<tracked_type const*>(this)));
+    return m_tracker;
+  }
+
+ protected:
+  PooledTrackedObject() { tracker(); }
+
+  PooledTrackedObject(PooledTrackedObject&& orig) : m_tracker(std::move(orig.m_tracker))
+  {
+    if (m_tracker)
+      m_tracker->set_tracked_object(static_cast<tracked_type*>(this));
+  }
+
+ public:
+  operator std::weak_ptr<Tracker>() const { return tracker(); }
+};
+
+//=============================================================================
+// The original, as in object_tracker_test.cxx.
+
+struct Node;
+
+class NodeTracker : public utils::ObjectTracker<Node>
+{
+ public:
+  NodeTracker(utils::Badge<utils::TrackedObject<NodeTracker>>, Node* tracked) : utils::ObjectTracker<Node>(tracked) { }
+};
+
+class Node : public utils::TrackedObject<NodeTracker>
+{
+ private:
+  std::string s_;
+
+ public:
+  Node(std::string const& s) : s_(s) { }
+
+  std::string const& s() const { return s_; }
+};
+
+//=============================================================================
+// The same, using a pooled tracker.
+
+struct PooledNode;
+using PooledNodeTracker = PooledObjectTracker<PooledNode>;
+
+struct PooledNode : public PooledTrackedObject<PooledNodeTracker>
+{
+ private:
+  std::string s_;
+
+ public:
+  PooledNode(std::string const& s) : s_(s) { }
+
+  std::string const& s() const { return s_; }
+};
+
+template<typename NODE, typename TRACKER>
+double create_move_destroy(std::string const& s)
+{
+  constexpr int count = 10000000;
+  constexpr int batch = 1000;
+  std::vector<NODE> nodes;
+  nodes.reserve(batch);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i += batch)
+  {
+    for (int j = 0; j < batch; ++j)
+    {
+      NODE node(s);
+      nodes.push_back(std::move(node));
+    }
+    std::weak_ptr<TRACKER> tracker = nodes.back();
+    ASSERT(&tracker.lock()->tracked_object() == &nodes.back());
+    nodes.clear();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The same test as object_tracker_test.cxx.
+  PooledNode node("This is a long string so that it won't be put inside the std::string.");
+  std::weak_ptr<PooledNodeTracker> node_tracker = node;
+  PooledNode node2(std::move(node));
+  ASSERT(node.s().empty());
+  std::cout << "tracked.s = " << node_tracker.lock()->tracked_object().s() << std::endl;
+  ASSERT(&node_tracker.lock()->tracked_object() == &node2);
+  // The moved-from object gets a new tracker.
+  std::weak_ptr<PooledNodeTracker> node_tracker0 = node;
+  ASSERT(&node_tracker0.lock()->tracked_object() == &node);
+
+  // Trackers allocated by a thread that exits before they are destroyed, by another thread.
+  {
+    std::vector<PooledNode> nodes;
+    nodes.reserve(1000);
+    std::thread([&]{
+      for (int i = 0; i < 1000; ++i)
+        nodes.emplace_back("node");
+    }).join();
+    std::vector<std::weak_ptr<PooledNodeTracker>> trackers(nodes.begin(), nodes.end());
+    for (size_t i = 0; i < nodes.size(); ++i)
+      ASSERT(&trackers[i].lock()->tracked_object() == &nodes[i]);
+    std::thread([&]{
+      nodes.clear();
+      // Reuse the blocks that the first thread handed over when it exited.
+      std::vector<PooledNode> more_nodes;
+      for (int i = 0; i < 1000; ++i)
+        more_nodes.emplace_back("more");
+    }).join();
+  }
+
+  // Allocations and deallocations by a thread after its free list was destroyed.
+  {
+    std::vector<PooledNode> nodes;
+    nodes.reserve(1);
+    std::thread([&]{
+      // Constructed before the free list of this thread, so destroyed after it.
+      struct ExitNodes
+      {
+        std::vector<PooledNode>& m_nodes;
+        ~ExitNodes()
+        {
+          // Free the tracker of the node that was created while the free list existed,
+          // and allocate one that outlives the thread.
+          m_nodes.clear();
+          m_nodes.emplace_back("exit");
+        }
+      };
+      static thread_local ExitNodes exit_nodes{nodes};
+      nodes.emplace_back("thread");
+    }).join();
+    ASSERT(nodes.size() == 1 && nodes[0].s() == "exit");
+    std::weak_ptr<PooledNodeTracker> tracker = nodes[0];
+    ASSERT(&tracker.lock()->tracked_object() == &nodes[0]);
+  }
+
+  // Short strings, so that the only heap allocation is the tracker.
+  std::string const s = "short";
+  std::cout << "utils::TrackedObject: " << create_move_destroy<Node, NodeTracker>(s) << " ns per create/move/destroy." << std::endl;
+  std::cout << "PooledTrackedObject: " << create_move_destroy<PooledNode, PooledNodeTracker>(s) << " ns per create/move/destroy." << std::endl;
+
+  Dout(dc::notice, "Success");
+}
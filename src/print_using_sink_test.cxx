@@ -0,0 +1,479 @@
+#include "sys.h"
+#include "debug.h"
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <concepts>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// A lightweight output sink: a growable char buffer that starts with inline storage.
+//
+// Writing to it is a memcpy, without the sentry, locale and virtual calls of a std::ostream.
+// Integers and floating point values are formatted with std::to_chars; the latter in
+// the shortest representation that round-trips (a std::ostream uses precision 6).
+class FormatBuffer
+{
+ public:
+  static constexpr size_t inline_capacity = 256;
+
+ private:
+  std::array<char, inline_capacity> m_inline;
+  std::unique_ptr<char[]> m_heap;       // Used once more than inline_capacity characters are written.
+  char* m_begin;
+  char* m_end;                          // One past the last character written.
+  char* m_capacity_end;
+
+  void grow(size_t extra)
+  {
+    size_t const size = m_end - m_begin;
+    size_t const capacity = std::max(2 * static_cast<size_t>(m_capacity_end - m_begin), size + extra);
+    auto heap = std::make_unique_for_overwrite<char[]>(capacity);
+    std::memcpy(heap.get(), m_begin, size);
+    m_heap = std::move(heap);
+    m_begin = m_heap.get();
+    m_end = m_begin + size;
+    m_capacity_end = m_begin + capacity;
+  }
+
+  template<typename T>
+  FormatBuffer& append_number(T value)
+  {
+    constexpr size_t max_size = 32;
+    if (m_capacity_end - m_end < static_cast<ptrdiff_t>(max_size))
+      grow(max_size);
+    m_end = std::to_chars(m_end, m_capacity_end, value).ptr;
+    return *this;
+  }
+
+ public:
+  FormatBuffer()
+  {
+    m_begin = m_end = m_inline.data();
+    m_capacity_end = m_begin + inline_capacity;
+  }
+  FormatBuffer(FormatBuffer const&) = delete;
+  FormatBuffer& operator=(FormatBuffer const&) = delete;
+
+  void append(char const* data, size_t size)
+  {
+    if (static_cast<size_t>(m_capacity_end - m_end) < size)
+      grow(size);
+    std::memcpy(m_end, data, size);
+    m_end += size;
+  }
+
+  void push_back(char c)
+  {
+    if (m_end == m_capacity_end)
+      grow(1);
+    *m_end++ = c;
+  }
+
+  void clear() { m_end = m_begin; }
+  size_t size() const { return m_end - m_begin; }
+  std::string_view view() const { return { m_begin, size() }; }
+
+  FormatBuffer& operator<<(std::string_view str) { append(str.data(), str.size()); return *this; }
+  FormatBuffer& operator<<(char const* str) { return *this << std::string_view{str}; }
+  FormatBuffer& operator<<(char c) { push_back(c); return *this; }
+  template<typename T>
+  requires (std::integral<T> || std::floating_point<T>) && (!std::same_as<T, char>) && (!std::same_as<T, bool>)
+  FormatBuffer& operator<<(T value) { return append_number(value); }
+  FormatBuffer& operator<<(bool value) { return *this << (value ? std::string_view{"true"} : std::string_view{"false"}); }
+
+  friend std::ostream& operator<<(std::ostream& os, FormatBuffer const& buffer) { return os.write(buffer.m_begin, buffer.size()); }
+};
+
+// A std::streambuf that appends to a FormatBuffer: used to call a print_on(std::ostream&) when printing to a FormatBuffer.
+class FormatBufferStreambuf : public std::streambuf
+{
+ private:
+  FormatBuffer& m_buffer;
+
+ protected:
+  int_type overflow(int_type c) override
+  {
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+      m_buffer.push_back(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(char const* s, std::streamsize n) override
+  {
+    m_buffer.append(s, n);
+    return n;
+  }
+
+ public:
+  FormatBufferStreambuf(FormatBuffer& buffer) : m_buffer(buffer) { }
+};
+
+// Like utils::print_using(obj, print_on), where print_on can print to a FormatBuffer, to a std::ostream, or both.
+//
+// print_on is a function (pointer) or callable object taking (Out&, object), or a member function
+// pointer of the object taking (Out&), where Out is either FormatBuffer or std::ostream. If obj
+// is a pointer, or a smart pointer, the object that it points to is printed.
+//
+// Writing a PrintUsing to a FormatBuffer calls the FormatBuffer overload if it exists, and
+// writing it to a std::ostream calls the std::ostream overload if it exists. Otherwise
+// the output goes through the other one: a temporary FormatBuffer, or a std::ostream
+// that writes to the FormatBuffer.
+//
+// A function pointer can only point to one of the overloads. print_using(obj, print_on)
+// and print_using(obj, &Foo::print_on) with an overloaded print_on pick the std::ostream
+// overload, as with utils::print_using; pass any_print_on to dispatch by name instead
+// (see below).
+template<typename T, typename PrintOn>
+class PrintUsing
+{
+ private:
+  T const& m_obj;
+  PrintOn m_print_on;
+
+  decltype(auto) object() const
+  {
+    if constexpr (std::is_pointer_v<T> || requires { m_obj.operator->(); })
+      return *m_obj;
+    else
+      return (m_obj);
+  }
+
+  using object_type = std::remove_cvref_t<decltype(std::declval<PrintUsing const&>().object())>;
+
+  template<typename Out>
+  static constexpr bool prints_to =
+      std::is_member_function_pointer_v<PrintOn> ? std::is_invocable_v<PrintOn const&, object_type const&, Out&>
+                                                 : std::is_invocable_v<PrintOn const&, Out&, object_type const&>;
+
+  static_assert(prints_to<FormatBuffer> || prints_to<std::ostream>, "print_on must take a FormatBuffer& or a std::ostream&.");
+
+  template<typename Out>
+  void print_on(Out& out) const
+  {
+    if constexpr (std::is_member_function_pointer_v<PrintOn>)
+      std::invoke(m_print_on, object(), out);
+    else
+      std::invoke(m_print_on, out, object());
+  }
+
+ public:
+  PrintUsing(T const& obj, PrintOn print_on) : m_obj(obj), m_print_on(print_on) { }
+
+  friend FormatBuffer& operator<<(FormatBuffer& buffer, PrintUsing const& print_using)
+  {
+    if constexpr (prints_to<FormatBuffer>)
+      print_using.print_on(buffer);
+    else
+    {
+      FormatBufferStreambuf streambuf(buffer);
+      std::ostream os(&streambuf);
+      print_using.print_on(os);
+    }
+    return buffer;
+  }
+
+  friend std::ostream& operator<<(std::ostream& os, PrintUsing const& print_using)
+  {
+    if constexpr (prints_to<std::ostream>)
+      print_using.print_on(os);
+    else
+    {
+      FormatBuffer buffer;
+      print_using.print_on(buffer);
+      os << buffer;
+    }
+    return os;
+  }
+};
+
+// The type of the object that print_using(obj, ...) prints: obj, or what it points to.
+template<typename T>
+struct print_object
+{
+  using type = std::remove_cvref_t<decltype(*std::declval<T const&>())>;
+};
+
+template<typename T>
+requires (!std::is_pointer_v<T> && !requires (T const& obj) { obj.operator->(); })
+struct print_object<T>
+{
+  using type = std::remove_cv_t<T>;
+};
+
+template<typename T>
+using print_object_t = typename print_object<T>::type;
+
+template<typename T, typename PrintOn>
+PrintUsing<T, PrintOn> print_using(T const& obj, PrintOn print_on)
+{
+  return { obj, print_on };
+}
+
+// The idioms print_using(obj, print_on) and print_using(obj, &Foo::print_on) of print_using.cxx.
+// Because the type of the function (pointer) doesn't depend on a deduced template parameter,
+// it is picked from an overloaded print_on that also has FormatBuffer overloads.
+template<typename T>
+PrintUsing<T, void (*)(std::ostream&, print_object_t<T> const&)>
+print_using(T const& obj, void (*print_on)(std::ostream&, print_object_t<T> const&))
+{
+  return { obj, print_on };
+}
+
+template<typename T>
+PrintUsing<T, void (*)(std::ostream&, print_object_t<T>)>
+print_using(T const& obj, void (*print_on)(std::ostream&, print_object_t<T>))
+{
+  return { obj, print_on };
+}
+
+template<typename T>
+PrintUsing<T, void (print_object_t<T>::*)(std::ostream&) const>
+print_using(T const& obj, void (print_object_t<T>::*print_on)(std::ostream&) const)
+{
+  return { obj, print_on };
+}
+
+namespace detail {
+
+void print_on() = delete;       // Hide every other print_on from ordinary lookup; only those found by ADL remain.
+
+struct AnyPrintOn
+{
+  template<typename Out, typename U>
+  auto operator()(Out& out, U const& obj) const -> decltype(obj.print_on(out))
+  {
+    return obj.print_on(out);
+  }
+
+  template<typename Out, typename U>
+  auto operator()(Out& out, U const& obj) const -> decltype(print_on(out, obj))
+  requires (!requires { obj.print_on(out); })
+  {
+    return print_on(out, obj);
+  }
+};
+
+} // namespace detail
+
+// Dispatch by name: print_using(obj, any_print_on) calls obj.print_on(out), or else print_on(out, obj)
+// found by ADL, for out a FormatBuffer or a std::ostream; whichever of those exist.
+inline constexpr detail::AnyPrintOn any_print_on;
+
+// The FormatBuffer equivalent of utils::has_print_on::operator<< (see to_string.cxx):
+// bring it in scope with `using format_buffer::has_print_on::operator<<;`.
+namespace format_buffer::has_print_on {
+
+template<typename T>
+concept prints_to_format_buffer = requires (T const& obj, FormatBuffer& buffer) { obj.print_on(buffer); };
+
+template<typename T>
+concept prints_to_ostream = requires (T const& obj, std::ostream& os) { obj.print_on(os); };
+
+// Write obj to a FormatBuffer, using its print_on(FormatBuffer&) if it has one, otherwise its print_on(std::ostream&).
+template<typename T>
+requires prints_to_format_buffer<T> || prints_to_ostream<T>
+FormatBuffer& operator<<(FormatBuffer& buffer, T const& obj)
+{
+  if constexpr (prints_to_format_buffer<T>)
+    obj.print_on(buffer);
+  else
+  {
+    FormatBufferStreambuf streambuf(buffer);
+    std::ostream os(&streambuf);
+    obj.print_on(os);
+  }
+  return buffer;
+}
+
+// Write an object that only has a print_on(FormatBuffer&) to a std::ostream.
+template<typename T>
+requires prints_to_format_buffer<T> && (!prints_to_ostream<T>)
+std::ostream& operator<<(std::ostream& os, T const& obj)
+{
+  FormatBuffer buffer;
+  obj.print_on(buffer);
+  return os << buffer;
+}
+
+} // namespace format_buffer::has_print_on
+
+//=============================================================================
+// The same Foo as print_using.cxx, that now can also print to a FormatBuffer.
+
+class Foo
+{
+ public:
+  Foo() = default;
+  Foo(Foo const&) = delete;
+  void print_on(std::ostream& os) const { os << "member function"; }
+  void print_on(FormatBuffer& buffer) const { buffer << "member function"; }
+};
+
+void print_on(std::ostream& os, Foo const&)
+{
+  os << "global function";
+}
+
+void print_on(FormatBuffer& buffer, Foo const&)
+{
+  buffer << "global function";
+}
+
+// More overloads of print_on, as in print_using.cxx.
+void print_on(std::ostream& os, double d)
+{
+  os << "global function by value: " << d;
+}
+
+void print_on(FormatBuffer& buffer, double d)
+{
+  buffer << "global function by value: " << d;
+}
+
+// Classes that can only print to one of the two.
+struct OnlyOstream
+{
+  int m_x = 42;
+  void print_on(std::ostream& os) const { os << "OnlyOstream{" << m_x << '}'; }
+};
+
+struct OnlyFormatBuffer
+{
+  double m_x = 0.5;
+  void print_on(FormatBuffer& buffer) const { buffer << "OnlyFormatBuffer{" << m_x << '}'; }
+};
+
+using format_buffer::has_print_on::operator<<;
+
+// A std::streambuf that writes to a fixed array, so that the std::ostream benchmark doesn't allocate either.
+class ArrayStreambuf : public std::streambuf
+{
+ private:
+  std::array<char, 256> m_array;
+
+ public:
+  ArrayStreambuf() { reset(); }
+  void reset() { setp(m_array.data(), m_array.data() + m_array.size()); }
+  std::string_view view() const { return { pbase(), static_cast<size_t>(pptr() - pbase()) }; }
+};
+
+template<typename F>
+void test(F foo, char const* name)
+{
+  constexpr int iterations = 1000000;
+  using buffer_print_on_t = void (*)(FormatBuffer&, Foo const&);
+
+  ArrayStreambuf streambuf;
+  std::ostream os(&streambuf);
+  FormatBuffer buffer;
+
+  // The idioms of print_using.cxx still compile with the FormatBuffer overloads present, and pick the std::ostream
+  // overload; any_print_on picks the overload that matches the output. All must give the same result.
+  os << print_using(foo, print_on) << ", " << print_using(foo, &Foo::print_on) << ' ' << 12345;
+  buffer << print_using(foo, print_on) << ", " << print_using(foo, &Foo::print_on) << ' ' << 12345;
+  Dout(dc::notice, "test<" << name << ">: " << buffer);
+  ASSERT(streambuf.view() == buffer.view());
+  buffer.clear();
+  buffer << print_using(foo, static_cast<buffer_print_on_t>(print_on)) << ", " << print_using(foo, any_print_on) << ' ' << 12345;
+  ASSERT(streambuf.view() == buffer.view());
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    streambuf.reset();
+    os << print_using(foo, print_on) << ", " << print_using(foo, &Foo::print_on) << ' ' << i;
+  }
+  auto middle = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    buffer.clear();
+    buffer << print_using(foo, static_cast<buffer_print_on_t>(print_on)) << ", " << print_using(foo, any_print_on) << ' ' << i;
+  }
+  auto end = std::chrono::steady_clock::now();
+  ASSERT(streambuf.view() == buffer.view());
+  std::cout << "test<" << name << ">: std::ostream " << std::chrono::duration<double, std::nano>(middle - start).count() / iterations <<
+    " ns, FormatBuffer " << std::chrono::duration<double, std::nano>(end - middle).count() / iterations << " ns per line." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // Printing to the other kind of output.
+  {
+    OnlyOstream only_ostream;
+    OnlyFormatBuffer only_format_buffer;
+    FormatBuffer buffer;
+    buffer << print_using(only_ostream, &OnlyOstream::print_on) << ' ' << print_using(only_format_buffer, &OnlyFormatBuffer::print_on);
+    ArrayStreambuf streambuf;
+    std::ostream os(&streambuf);
+    os << print_using(only_ostream, &OnlyOstream::print_on) << ' ' << print_using(only_format_buffer, &OnlyFormatBuffer::print_on);
+    ASSERT(buffer.view() == "OnlyOstream{42} OnlyFormatBuffer{0.5}");
+    ASSERT(streambuf.view() == buffer.view());
+  }
+
+  // Objects with a print_on member, written directly (the has_print_on operator<<).
+  {
+    Foo foo;
+    OnlyOstream only_ostream;
+    OnlyFormatBuffer only_format_buffer;
+    FormatBuffer buffer;
+    buffer << foo << ' ' << only_ostream << ' ' << only_format_buffer;
+    ArrayStreambuf streambuf;
+    std::ostream os(&streambuf);
+    os << only_format_buffer;
+    ASSERT(buffer.view() == "member function OnlyOstream{42} OnlyFormatBuffer{0.5}");
+    ASSERT(streambuf.view() == "OnlyFormatBuffer{0.5}");
+  }
+
+  // A builtin type, with an overloaded print_on that takes it by value.
+  {
+    FormatBuffer buffer;
+    buffer << print_using(0.25, print_on) << "; " << print_using(0.25, any_print_on);
+    ASSERT(buffer.view() == "global function by value: 0.25; global function by value: 0.25");
+  }
+
+  // Growing beyond the inline storage.
+  {
+    FormatBuffer buffer;
+    std::string expected;
+    for (int i = 0; i < 1000; ++i)
+    {
+      buffer << i << ' ' << -0.25 * i << ';';
+      char number[32];
+      expected += std::to_string(i) + ' ';
+      expected.append(number, std::to_chars(number, number + sizeof(number), -0.25 * i).ptr);
+      expected += ';';
+    }
+    ASSERT(buffer.view().size() > FormatBuffer::inline_capacity);
+    ASSERT(buffer.view() == expected);
+  }
+
+  // The test<Foo...> variants of print_using.cxx.
+  test<Foo>(Foo(), "Foo");
+  test<Foo const>(Foo(), "Foo const");
+  Foo foo;
+  test<Foo&>(foo, "Foo&");
+  test<Foo const&>(foo, "Foo const&");
+  Foo* ptr = &foo;
+  test<Foo*>(ptr, "Foo*");
+  Foo const* const_ptr = &foo;
+  test<Foo const*>(const_ptr, "Foo const*");
+  test<Foo*&>(ptr, "Foo*&");
+  test<Foo* const&>(ptr, "Foo* const&");
+  test<Foo const*&>(const_ptr, "Foo const*&");
+  test<Foo const* const&>(const_ptr, "Foo const* const&");
+  std::shared_ptr<Foo> sptr = std::make_shared<Foo>();
+  test<std::shared_ptr<Foo>>(sptr, "std::shared_ptr<Foo>");
+  test<std::shared_ptr<Foo>&>(sptr, "std::shared_ptr<Foo>&");
+  test<std::shared_ptr<Foo> const&>(sptr, "std::shared_ptr<Foo> const&");
+
+  Dout(dc::notice, "Success");
+}
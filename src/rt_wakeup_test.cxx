@@ -0,0 +1,165 @@
+#include "sys.h"
+#include "utils/Signals.h"
+#include "debug.h"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Wake up a worker thread with an RT signal, coalescing notifications.
+//
+// Each worker has a pending mask of up to 63 event bits. Notifying sets
+// bits in that mask with a single atomic OR; only the first notification
+// after the worker went to sleep sends the RT signal (with pthread_sigqueue,
+// so the si_value payload reaches the worker itself and not just any thread).
+// The RT signal must be blocked in all threads; the worker waits for it
+// with sigwaitinfo.
+class WakeupTarget
+{
+ public:
+  static constexpr uint64_t sleeping_bit = uint64_t{1} << 63;   // Set by the worker when it is about to sleep.
+
+ private:
+  std::atomic<uint64_t> m_pending{0};
+  pthread_t m_thread;
+  int m_signum;
+  std::atomic<long> m_signals_sent{0};
+
+ public:
+  // Must be called by the worker thread itself.
+  WakeupTarget(int signum) : m_thread(pthread_self()), m_signum(signum) { }
+
+  // Post events (a mask without sleeping_bit) to the worker. The payload is passed along
+  // with the RT signal when the worker has to be woken up. Notifications that are coalesced
+  // with an earlier one don't send a signal: their payload is dropped (only the events arrive).
+  void notify(uint64_t events, sigval payload = {})
+  {
+    ASSERT(events && !(events & sleeping_bit));
+    if (m_pending.fetch_or(events, std::memory_order_release) == sleeping_bit)
+    {
+      m_signals_sent.fetch_add(1, std::memory_order_relaxed);
+      int error;
+      // EAGAIN: the RT signal queue limit was reached; retry until the worker dequeued one.
+      while ((error = pthread_sigqueue(m_thread, m_signum, payload)) == EAGAIN)
+        std::this_thread::yield();
+      if (error)
+        DoutFatal(dc::core, "pthread_sigqueue: " << std::strerror(error));
+    }
+  }
+
+  // Called by the worker: return the pending events, sleeping until there is at least one.
+  uint64_t wait(siginfo_t* info = nullptr)
+  {
+    uint64_t events = m_pending.exchange(0, std::memory_order_acquire);
+    if (events)
+      return events;
+    uint64_t expected = 0;
+    if (m_pending.compare_exchange_strong(expected, sleeping_bit, std::memory_order_acquire))
+    {
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, m_signum);
+      siginfo_t ignored;
+      while (sigwaitinfo(&set, info ? info : &ignored) == -1)
+        ASSERT(errno == EINTR);
+    }
+    // Either we were woken up, or events were added before we went to sleep.
+    return m_pending.exchange(0, std::memory_order_acquire) & ~sleeping_bit;
+  }
+
+  long signals_sent() const { return m_signals_sent.load(std::memory_order_relaxed); }
+};
+
+constexpr int number_of_notifications = 1000000;
+
+// The plain approach, as used in signal_test.cxx: one kill() per notification.
+double benchmark_kill(int s1)
+{
+  std::thread worker([s1](){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, s1);
+    for (int received = 0; received < number_of_notifications;)
+      if (sigwaitinfo(&set, nullptr) == s1)
+        ++received;
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < number_of_notifications; ++i)
+  {
+    // Retry when the queue of pending RT signals is full.
+    while (kill(getpid(), s1) == -1)
+    {
+      ASSERT(errno == EAGAIN);
+      std::this_thread::yield();
+    }
+  }
+  worker.join();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+double benchmark_wakeup_target(int s1)
+{
+  constexpr uint64_t stop_bit = uint64_t{1} << 62;
+  std::atomic<WakeupTarget*> target{nullptr};
+  uint64_t seen = 0;
+
+  std::thread worker([&](){
+    WakeupTarget self(s1);
+    target = &self;
+    uint64_t events;
+    do
+    {
+      events = self.wait();
+      seen |= events;
+    }
+    while (!(events & stop_bit));
+    std::cout << "WakeupTarget sent " << self.signals_sent() << " RT signals for " << number_of_notifications << " notifications." << std::endl;
+  });
+
+  WakeupTarget* t;
+  while (!(t = target.load()))
+    std::this_thread::yield();
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < number_of_notifications; ++i)
+    t->notify(uint64_t{1} << (i % 62), { .sival_int = i });
+  t->notify(stop_bit);
+  worker.join();
+  auto end = std::chrono::steady_clock::now();
+
+  // Every event bit must have been delivered.
+  ASSERT(seen == ((stop_bit << 1) - 1));
+  return std::chrono::duration<double>(end - start).count();
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // This process uses 1 RT signal.
+  utils::Signals signals({}, 1);
+  int s1 = utils::Signal::next_rt_signum();
+  Dout(dc::notice, "Reserved RT signals: " << s1 << '.');
+
+  // Block s1 in all threads, we use sigwaitinfo to receive it.
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, s1);
+  if (int error = pthread_sigmask(SIG_BLOCK, &set, nullptr))
+    DoutFatal(dc::core, "pthread_sigmask: " << std::strerror(error));
+
+  double kill_time = benchmark_kill(s1);
+  std::cout << "kill(getpid(), s1): " << (number_of_notifications / kill_time) << " notifications per second." << std::endl;
+  double wakeup_time = benchmark_wakeup_target(s1);
+  std::cout << "WakeupTarget::notify: " << (number_of_notifications / wakeup_time) << " notifications per second." << std::endl;
+
+  Dout(dc::notice, "Success!");
+}
@@ -0,0 +1,170 @@
+#include "sys.h"
+#include "utils/Signals.h"
+#include "debug.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <map>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+// Deliver signals through a signalfd instead of asynchronous signal handlers.
+//
+// The signals passed to the constructor are blocked in the calling thread,
+// so this object must be created before any other thread is started (which
+// then inherit the signal mask). A single reader drains the signals in batches
+// with drain() - for example when epoll reports that fd() is readable - and
+// calls the registered callbacks in normal thread context: they are not
+// limited to async-signal-safe functions.
+class SignalFd
+{
+ public:
+  using callback_type = std::function<void(signalfd_siginfo const&)>;
+  static constexpr int batch_size = 32;         // Maximum number of signals read per syscall.
+
+ private:
+  sigset_t m_mask;
+  int m_fd;
+  std::map<int, callback_type> m_callbacks;
+
+ public:
+  SignalFd(std::initializer_list<int> signums)
+  {
+    sigemptyset(&m_mask);
+    for (int signum : signums)
+      sigaddset(&m_mask, signum);
+    // pthread_sigmask returns the error number; it doesn't set errno.
+    if (int error = pthread_sigmask(SIG_BLOCK, &m_mask, nullptr))
+      throw std::system_error(error, std::system_category(), "pthread_sigmask");
+    m_fd = signalfd(-1, &m_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (m_fd == -1)
+      throw std::system_error(errno, std::system_category(), "signalfd");
+  }
+
+  ~SignalFd()
+  {
+    close(m_fd);
+  }
+
+  SignalFd(SignalFd const&) = delete;
+
+  // Register the callback for signal signum. Must be called before the reader is started.
+  void register_callback(int signum, callback_type callback)
+  {
+    ASSERT(sigismember(&m_mask, signum));
+    m_callbacks[signum] = std::move(callback);
+  }
+
+  // The file descriptor to add to epoll (EPOLLIN).
+  int fd() const { return m_fd; }
+
+  // Read all pending signals and dispatch them. Returns the number of signals handled.
+  int drain()
+  {
+    std::array<signalfd_siginfo, batch_size> batch;
+    int handled = 0;
+    for (;;)
+    {
+      ssize_t len = read(m_fd, batch.data(), sizeof(batch));
+      if (len == -1)
+      {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN)
+          break;
+        throw std::system_error(errno, std::system_category(), "read(signalfd)");
+      }
+      int count = len / sizeof(signalfd_siginfo);
+      for (int i = 0; i < count; ++i)
+      {
+        auto callback = m_callbacks.find(batch[i].ssi_signo);
+        if (callback != m_callbacks.end())
+          callback->second(batch[i]);
+      }
+      handled += count;
+      if (count < batch_size)
+        break;
+    }
+    return handled;
+  }
+};
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // This process uses SIGUSR1 and 1 RT signal.
+  utils::Signals signals({SIGUSR1}, 1);
+  int s1 = utils::Signal::next_rt_signum();
+  Dout(dc::notice, "Reserved RT signals: " << s1 << '.');
+
+  // Must be created before starting the reader thread.
+  SignalFd signal_fd({SIGUSR1, s1});
+
+  constexpr int burst_size = 10000;
+  std::atomic<bool> got_SIGUSR1{false};
+  int next_value = 0;                           // Only accessed by the reader thread.
+  bool in_order = true;
+
+  signal_fd.register_callback(SIGUSR1, [&](signalfd_siginfo const&){ got_SIGUSR1 = true; });
+  signal_fd.register_callback(s1, [&](signalfd_siginfo const& info){
+      // RT signals are queued and delivered in order; check the payload.
+      in_order = in_order && info.ssi_int == next_value;
+      ++next_value;
+  });
+
+  std::thread reader([&](){
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+      throw std::system_error(errno, std::system_category(), "epoll_create1");
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = signal_fd.fd();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd.fd(), &event) == -1)
+      throw std::system_error(errno, std::system_category(), "epoll_ctl");
+    int reads = 0;
+    while (next_value < burst_size || !got_SIGUSR1)
+    {
+      epoll_event ready;
+      if (epoll_wait(epoll_fd, &ready, 1, 1000) == 1)
+      {
+        signal_fd.drain();
+        ++reads;
+      }
+    }
+    close(epoll_fd);
+    std::cout << "Handled " << next_value << " RT signals with " << reads << " wake-ups of the reader." << std::endl;
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  for (int value = 0; value < burst_size; ++value)
+  {
+    sigval payload;
+    payload.sival_int = value;
+    // Retry when the queue of pending RT signals is full.
+    while (sigqueue(getpid(), s1, payload) == -1)
+    {
+      ASSERT(errno == EAGAIN);
+      std::this_thread::yield();
+    }
+  }
+  kill(getpid(), SIGUSR1);
+  reader.join();
+  auto end = std::chrono::steady_clock::now();
+
+  std::cout << "Sending and dispatching " << burst_size << " RT signals took " <<
+    std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / burst_size << " ns per signal." << std::endl;
+
+  ASSERT(in_order);
+  ASSERT(got_SIGUSR1);
+  Dout(dc::notice, "Success!");
+}
@@ -0,0 +1,245 @@
+#include "sys.h"
+#include "utils/Register.h"
+#include "debug.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Registration without dynamic initialization.
+//
+// STATIC_REGISTER(T, name, callback) defines a constexpr StaticRegistration in the
+// linker section "utils_register". The linker collects all of them into one array,
+// delimited by __start_utils_register and __stop_utils_register, so that the list
+// exists before any code runs. run_static_registrations() walks that array and
+// calls every callback with the number of registrations of its type, like
+// utils::RegisterGlobals::finish_registration() does for utils::Register<T>.
+// The compiler is free to reorder the objects of one translation unit, so the
+// order in which the callbacks are called is unspecified.
+//
+// The linker creates the section, and its __start_/__stop_ symbols, per linked
+// object: the executable and every shared library have their own array. The
+// symbols are resolved to those of one object (normally the executable), so
+// registrations in shared libraries (including dlopen-ed ones) are not seen.
+// Use utils::Register for those.
+struct StaticRegistration
+{
+  void const* m_type;                   // &static_registration_key<T>.
+  void (*m_callback)(size_t n);
+};
+
+template<typename T>
+inline constexpr char static_registration_key = 0;
+
+// Every registration must be a constant: a captureless lambda or a function pointer.
+// Can not be used for variable templates: gcc ignores the section attribute of their instantiations.
+#define STATIC_REGISTER(T, name, ...) \
+  [[gnu::section("utils_register"), gnu::used]] \
+  constexpr StaticRegistration name = { &static_registration_key<T>, __VA_ARGS__ }
+
+// Defined by the linker. Weak, so that a program without registrations still links.
+extern "C" {
+[[gnu::weak]] extern StaticRegistration const __start_utils_register[];
+[[gnu::weak]] extern StaticRegistration const __stop_utils_register[];
+}
+
+enum class registration_policy
+{
+  sequential,                   // All callbacks in the calling thread.
+  parallel_per_type             // Callbacks of different types concurrently; those of the same type one after another, in the same thread.
+};
+
+void run_static_registrations(registration_policy policy = registration_policy::sequential)
+{
+  StaticRegistration const* const begin = __start_utils_register;
+  StaticRegistration const* const end = __stop_utils_register;
+  if (begin == end)
+    return;
+
+  // Count the registrations per type.
+  std::vector<void const*> types;                       // In order of first appearance.
+  std::unordered_map<void const*, size_t> count;
+  for (StaticRegistration const* registration = begin; registration != end; ++registration)
+    if (count[registration->m_type]++ == 0)
+      types.push_back(registration->m_type);
+
+  unsigned int number_of_threads = std::min<size_t>(types.size(), std::thread::hardware_concurrency());
+  if (policy == registration_policy::sequential || number_of_threads <= 1)
+  {
+    for (StaticRegistration const* registration = begin; registration != end; ++registration)
+      registration->m_callback(count.find(registration->m_type)->second);
+    return;
+  }
+
+  // Bucket the registrations by type (counting sort, in the order of types): the registrations
+  // of types[t] are bucketed[bucket_begin[t]] .. bucketed[bucket_begin[t + 1] - 1].
+  std::unordered_map<void const*, size_t> type_index;
+  std::vector<size_t> bucket_begin(types.size() + 1);
+  for (size_t t = 0; t < types.size(); ++t)
+  {
+    type_index.emplace(types[t], t);
+    bucket_begin[t + 1] = bucket_begin[t] + count.find(types[t])->second;
+  }
+  std::vector<StaticRegistration const*> bucketed(end - begin);
+  {
+    std::vector<size_t> next(bucket_begin.begin(), bucket_begin.end() - 1);
+    for (StaticRegistration const* registration = begin; registration != end; ++registration)
+      bucketed[next[type_index.find(registration->m_type)->second]++] = registration;
+  }
+
+  auto run_type = [&](size_t t){
+    size_t const n = bucket_begin[t + 1] - bucket_begin[t];
+    for (size_t i = bucket_begin[t]; i < bucket_begin[t + 1]; ++i)
+      bucketed[i]->m_callback(n);
+  };
+
+  // Every thread runs all callbacks of the next type that wasn't claimed yet.
+  std::atomic<size_t> next_type{0};
+  auto worker = [&](){
+    for (size_t t; (t = next_type.fetch_add(1, std::memory_order_relaxed)) < types.size();)
+      run_type(t);
+  };
+  std::vector<std::thread> threads;
+  for (unsigned int t = 1; t < number_of_threads; ++t)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+//=============================================================================
+// The same registrations as register_test.cxx.
+
+struct A {
+  int n;
+};
+
+struct B {
+  int n;
+};
+
+static constexpr A a1 = { 1 };
+static constexpr A a2 = { 2 };
+
+static constexpr B b1 = { 1 };
+static constexpr B b2 = { 2 };
+
+// Only the callbacks of one type write to the same vector, so those of A and B can run concurrently.
+std::vector<std::pair<int, size_t>> a_calls;
+std::vector<std::pair<int, size_t>> b_calls;
+
+void callback(size_t n, A const& a)
+{
+  a_calls.emplace_back(a.n, n);
+}
+
+void callback(size_t n, B const& b, char const* message)
+{
+  ASSERT(*message == 'b');
+  b_calls.emplace_back(b.n, n);
+}
+
+namespace {
+STATIC_REGISTER(A, a1_, [](size_t n){ callback(n, a1); });
+STATIC_REGISTER(A, a2_, [](size_t n){ callback(n, a2); });
+STATIC_REGISTER(B, b1_, [](size_t n){ callback(n, b1, "b1"); });
+STATIC_REGISTER(B, b2_, [](size_t n){ callback(n, b2, "b2"); });
+}
+
+//=============================================================================
+// Startup benchmark: number_of_registrations registrations, spread over number_of_types types.
+
+constexpr int number_of_registrations = 10000;
+constexpr int number_of_types = 8;
+
+template<int K>
+struct Plugin {
+};
+
+size_t plugin_sum[number_of_types];
+
+template<int K>
+void plugin_callback(size_t n)
+{
+  plugin_sum[K] += n;
+}
+
+// Generate the registrations with the preprocessor: the section attribute is ignored for template instantiations.
+#define REGISTER_PLUGIN(I) REGISTER_PLUGIN_EXPANDED(I)
+#define REGISTER_PLUGIN_EXPANDED(I) \
+  utils::Register<Plugin<I % number_of_types>> dynamic_registration##I(plugin_callback<I % number_of_types>); \
+  STATIC_REGISTER(Plugin<I % number_of_types>, static_registration##I, plugin_callback<I % number_of_types>);
+#define REGISTER_PLUGINS10 \
+  REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__) \
+  REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__) REGISTER_PLUGIN(__COUNTER__)
+#define REGISTER_PLUGINS100 \
+  REGISTER_PLUGINS10 REGISTER_PLUGINS10 REGISTER_PLUGINS10 REGISTER_PLUGINS10 REGISTER_PLUGINS10 \
+  REGISTER_PLUGINS10 REGISTER_PLUGINS10 REGISTER_PLUGINS10 REGISTER_PLUGINS10 REGISTER_PLUGINS10
+#define REGISTER_PLUGINS1000 \
+  REGISTER_PLUGINS100 REGISTER_PLUGINS100 REGISTER_PLUGINS100 REGISTER_PLUGINS100 REGISTER_PLUGINS100 \
+  REGISTER_PLUGINS100 REGISTER_PLUGINS100 REGISTER_PLUGINS100 REGISTER_PLUGINS100 REGISTER_PLUGINS100
+
+namespace {
+// 10 * 1000 registrations of each kind.
+REGISTER_PLUGINS1000 REGISTER_PLUGINS1000 REGISTER_PLUGINS1000 REGISTER_PLUGINS1000 REGISTER_PLUGINS1000
+REGISTER_PLUGINS1000 REGISTER_PLUGINS1000 REGISTER_PLUGINS1000 REGISTER_PLUGINS1000 REGISTER_PLUGINS1000
+}
+
+// The time between the first constructor and main() is the dynamic initialization that utils::Register needs.
+std::chrono::steady_clock::time_point dynamic_initialization_start;
+[[gnu::constructor(101)]] void start_of_dynamic_initialization()
+{
+  dynamic_initialization_start = std::chrono::steady_clock::now();
+}
+
+int main()
+{
+  auto const start_of_main = std::chrono::steady_clock::now();
+  Debug(NAMESPACE_DEBUG::init());
+
+  using us = std::chrono::duration<double, std::micro>;
+  std::cout << "Dynamic initialization: " << us(start_of_main - dynamic_initialization_start).count() << " us." << std::endl;
+
+  auto start = std::chrono::steady_clock::now();
+  utils::RegisterGlobals::finish_registration();
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "utils::RegisterGlobals::finish_registration(): " << us(end - start).count() << " us." << std::endl;
+  size_t const expected_sum = plugin_sum[0];
+  for (size_t& sum : plugin_sum)
+    sum = 0;
+
+  for (registration_policy policy : { registration_policy::sequential, registration_policy::parallel_per_type })
+  {
+    a_calls.clear();
+    b_calls.clear();
+    start = std::chrono::steady_clock::now();
+    run_static_registrations(policy);
+    end = std::chrono::steady_clock::now();
+    std::sort(a_calls.begin(), a_calls.end());
+    std::sort(b_calls.begin(), b_calls.end());
+    std::cout << "run_static_registrations(" << (policy == registration_policy::sequential ? "sequential" : "parallel_per_type") << "): " <<
+      us(end - start).count() << " us." << std::endl;
+
+    for (auto const& call : a_calls)
+      std::cout << call.first << '/' << call.second << std::endl;
+    for (auto const& call : b_calls)
+      std::cout << call.first << '/' << call.second << " [b" << call.first << "]" << std::endl;
+    ASSERT((a_calls == std::vector<std::pair<int, size_t>>{ { 1, 2 }, { 2, 2 } }));
+    ASSERT((b_calls == std::vector<std::pair<int, size_t>>{ { 1, 2 }, { 2, 2 } }));
+
+    // Every type has number_of_registrations / number_of_types registrations.
+    for (size_t& sum : plugin_sum)
+    {
+      ASSERT(sum == expected_sum);
+      sum = 0;
+    }
+  }
+  ASSERT(expected_sum == (number_of_registrations / number_of_types) * (number_of_registrations / number_of_types));
+
+  Dout(dc::notice, "Success");
+}
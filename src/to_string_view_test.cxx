@@ -0,0 +1,264 @@
+#include "sys.h"
+#include "utils/to_string.h"
+#include "debug.h"
+#include <enchantum/enchantum.hpp>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Compile-time tables of the enumerator names of E, generated from enchantum reflection.
+//
+// to_string_view(e) returns a std::string_view into a constexpr table: an array
+// lookup if the values of E are contiguous, otherwise a binary search. Unlike
+// utils::to_string(e) it never allocates.
+//
+// from_string<E>(name) uses a perfect hash that is computed at compile time (hash
+// and displace): the 64-bit hash of name selects a bucket, and the displacement
+// of that bucket maps the names of the bucket to unique slots. A lookup thus hashes
+// the name once and does a single string compare.
+template<typename E>
+struct EnumTable
+{
+  static_assert(std::is_enum_v<E>);
+  using underlying_type = std::underlying_type_t<E>;
+  static constexpr size_t size = enchantum::count<E>;
+  static_assert(size > 0 && size < 0xffff);
+
+  // The enumerators, sorted by value.
+  static constexpr auto entries = []{
+    std::array<std::pair<underlying_type, std::string_view>, size> entries;
+    for (size_t i = 0; i < size; ++i)
+      entries[i] = { static_cast<underlying_type>(enchantum::values<E>[i]), enchantum::names<E>[i] };
+    std::sort(entries.begin(), entries.end());
+    return entries;
+  }();
+
+  static constexpr bool is_contiguous = []{
+    for (size_t i = 0; i < size; ++i)
+      if (entries[i].first != static_cast<underlying_type>(entries[0].first + i))
+        return false;
+    return true;
+  }();
+
+  //---------------------------------------------------------------------------
+  // Perfect hash.
+
+  using index_type = uint16_t;
+  static constexpr index_type empty = 0xffff;
+  static constexpr size_t number_of_buckets = std::bit_ceil(size);
+  static constexpr size_t number_of_slots = 2 * number_of_buckets;
+
+  // FNV-1a.
+  static constexpr uint64_t hash(std::string_view name)
+  {
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : name)
+      h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+    return h;
+  }
+
+  static constexpr size_t bucket(uint64_t h)
+  {
+    return (h >> 32) & (number_of_buckets - 1);
+  }
+
+  // The finalizer of splitmix64.
+  static constexpr size_t slot(uint64_t h, uint32_t displacement)
+  {
+    h += displacement * 0x9e3779b97f4a7c15;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return (h ^ (h >> 31)) & (number_of_slots - 1);
+  }
+
+  struct PerfectHash
+  {
+    std::array<uint32_t, number_of_buckets> m_displacement{};
+    std::array<index_type, number_of_slots> m_slots{};
+  };
+
+  static constexpr PerfectHash perfect_hash = []{
+    PerfectHash result;
+    result.m_slots.fill(empty);
+    // Place the buckets with the most names first.
+    std::array<size_t, number_of_buckets> bucket_size{};
+    for (auto const& entry : entries)
+      ++bucket_size[bucket(hash(entry.second))];
+    std::array<size_t, number_of_buckets> order;
+    for (size_t b = 0; b < number_of_buckets; ++b)
+      order[b] = b;
+    std::sort(order.begin(), order.end(), [&](size_t b1, size_t b2){ return bucket_size[b1] > bucket_size[b2]; });
+    for (size_t b : order)
+    {
+      if (bucket_size[b] == 0)
+        break;
+      // Find a displacement that maps all names of this bucket to different free slots.
+      for (uint32_t displacement = 0;; ++displacement)
+      {
+        std::array<size_t, number_of_slots> slots;
+        std::array<index_type, number_of_slots> indices;
+        size_t n = 0;
+        bool fits = true;
+        for (size_t i = 0; fits && i < size; ++i)
+        {
+          uint64_t const h = hash(entries[i].second);
+          if (bucket(h) != b)
+            continue;
+          size_t const s = slot(h, displacement);
+          fits = result.m_slots[s] == empty && std::find(slots.begin(), slots.begin() + n, s) == slots.begin() + n;
+          slots[n] = s;
+          indices[n++] = i;
+        }
+        if (fits)
+        {
+          for (size_t j = 0; j < n; ++j)
+            result.m_slots[slots[j]] = indices[j];
+          result.m_displacement[b] = displacement;
+          break;
+        }
+      }
+    }
+    return result;
+  }();
+};
+
+template<typename E>
+constexpr std::string_view to_string_view(E e)
+{
+  using table = EnumTable<E>;
+  auto const value = static_cast<typename table::underlying_type>(e);
+  if constexpr (table::is_contiguous)
+  {
+    size_t const index = static_cast<size_t>(value) - static_cast<size_t>(table::entries[0].first);
+    return index < table::size ? table::entries[index].second : std::string_view{};
+  }
+  else
+  {
+    auto entry = std::lower_bound(table::entries.begin(), table::entries.end(), value,
+        [](auto const& entry, auto value){ return entry.first < value; });
+    return entry != table::entries.end() && entry->first == value ? entry->second : std::string_view{};
+  }
+}
+
+template<typename E>
+constexpr std::optional<E> from_string(std::string_view name)
+{
+  using table = EnumTable<E>;
+  uint64_t const h = table::hash(name);
+  auto const index = table::perfect_hash.m_slots[table::slot(h, table::perfect_hash.m_displacement[table::bucket(h)])];
+  if (index != table::empty && table::entries[index].second == name)
+    return static_cast<E>(table::entries[index].first);
+  return std::nullopt;
+}
+
+//=============================================================================
+
+namespace N {
+
+// The same enum as to_string_enchantum.cxx.
+enum E3 {
+  e3_no_exclamation_mark_ok
+};
+
+enum class Opcode {
+  nop, load_immediate, load_indirect, load_indexed, store_indirect, store_indexed, push, pop,
+  add, add_with_carry, subtract, subtract_with_borrow, multiply, multiply_unsigned, divide, divide_unsigned,
+  bitwise_and, bitwise_or, bitwise_xor, bitwise_not, shift_left, shift_right_logical, shift_right_arithmetic, rotate_left,
+  rotate_right, compare, compare_unsigned, test, jump, jump_if_zero, jump_if_not_zero, jump_if_less,
+  jump_if_greater, call, call_indirect, return_from_call, system_call, breakpoint, halt, memory_fence,
+  load_acquire, store_release, compare_and_exchange, fetch_and_add, prefetch, flush_cache_line, read_timestamp, undefined_instruction
+};
+
+enum Sparse {
+  sparse_minus_hundred = -100, sparse_minus_one = -1, sparse_zero = 0, sparse_three = 3, sparse_seven = 7,
+  sparse_forty_two = 42, sparse_hundred = 100, sparse_two_hundred = 200
+};
+
+} // namespace N
+
+static_assert(to_string_view(N::e3_no_exclamation_mark_ok) == "e3_no_exclamation_mark_ok");
+static_assert(to_string_view(N::Opcode::undefined_instruction) == "undefined_instruction");
+static_assert(to_string_view(N::sparse_forty_two) == "sparse_forty_two");
+static_assert(to_string_view(static_cast<N::Sparse>(43)).empty());
+static_assert(from_string<N::Opcode>("fetch_and_add") == N::Opcode::fetch_and_add);
+static_assert(!from_string<N::Opcode>("fetch_and_subtract"));
+static_assert(EnumTable<N::Opcode>::is_contiguous && !EnumTable<N::Sparse>::is_contiguous);
+
+template<typename E>
+void test_all_enumerators()
+{
+  for (E e : enchantum::values<E>)
+  {
+    std::string_view name = to_string_view(e);
+    ASSERT(name == utils::to_string(e));       // The allocating to_string is still there, and agrees.
+    ASSERT(from_string<E>(name) == e);
+    ASSERT(!from_string<E>(std::string(name) + "_"));
+    ASSERT(!from_string<E>(name.substr(1)));
+  }
+}
+
+template<typename FUNCTION>
+double nanoseconds_per_call(int number_of_calls, FUNCTION function)
+{
+  double best = 1e9;
+  for (int round = 0; round < 3; ++round)
+  {
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < number_of_calls; ++i)
+      total += function(i);
+    auto end = std::chrono::steady_clock::now();
+    asm volatile ("" :: "r" (total));
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / number_of_calls);
+  }
+  return best;
+}
+
+template<typename E>
+void benchmark(char const* name)
+{
+  constexpr int number_of_calls = 10000000;
+  std::mt19937 gen(42);
+  std::vector<E> input(65536);
+  std::vector<std::string_view> names(input.size());
+  for (size_t i = 0; i < input.size(); ++i)
+  {
+    input[i] = enchantum::values<E>[gen() % enchantum::count<E>];
+    names[i] = enchantum::to_string(input[i]);
+  }
+  size_t const mask = input.size() - 1;
+  std::cout << name << ": utils::to_string " << nanoseconds_per_call(number_of_calls, [&](int i){
+      return utils::to_string(input[i & mask]).size();
+    }) << " ns, to_string_view " << nanoseconds_per_call(number_of_calls, [&](int i){
+      return to_string_view(input[i & mask]).size();
+    }) << " ns; enchantum::cast " << nanoseconds_per_call(number_of_calls, [&](int i){
+      return static_cast<size_t>(*enchantum::cast<E>(names[i & mask]));
+    }) << " ns, from_string " << nanoseconds_per_call(number_of_calls, [&](int i){
+      return static_cast<size_t>(*from_string<E>(names[i & mask]));
+    }) << " ns." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  test_all_enumerators<N::E3>();
+  test_all_enumerators<N::Opcode>();
+  test_all_enumerators<N::Sparse>();
+  Dout(dc::notice, "to_string_view(N::Opcode::compare_and_exchange) = " << to_string_view(N::Opcode::compare_and_exchange));
+
+  benchmark<N::Opcode>("Opcode (48 contiguous enumerators)");
+  benchmark<N::Sparse>("Sparse (8 enumerators)");
+
+  Dout(dc::notice, "Success");
+}
@@ -0,0 +1,342 @@
+#include "sys.h"
+#include "utils/VTPtr.h"
+#include "debug.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Batch dispatch of the VT_ptr functions of a heterogeneous set of objects.
+//
+// Calling a virtual function on every object of a container whose dynamic types are
+// mixed makes the target of the indirect call random, and the branch predictor misses
+// most of them. Because VTPtr turns the vtable into a value, VTBatch can group the
+// objects by the address of their VT_type once and then call a function of the VT_type
+// on each group in a loop whose target never changes.
+//
+// The results are passed to a callback, per group; not in the order of the objects
+// that were passed to assign(). An object whose VT was cloned (clone_VT()) has a
+// VT_type of its own, and therefore ends up in a group of its own.
+template<typename B>
+class VTBatch
+{
+ public:
+  using VT_type = typename B::VT_type;
+
+ private:
+  struct Group
+  {
+    VT_type const* m_VT;
+    std::vector<B*> m_objects;
+  };
+  std::vector<Group> m_groups;
+  std::unordered_map<VT_type const*, size_t> m_group_index;
+
+ public:
+  VTBatch() = default;
+  VTBatch(std::span<B* const> objects) { assign(objects); }
+
+  // (Re)group objects. Must be called again when an object is added or removed, or
+  // when the VT_ptr of one of the objects changes.
+  void assign(std::span<B* const> objects)
+  {
+    for (Group& group : m_groups)
+      group.m_objects.clear();      // Keep the capacity.
+    for (B* object : objects)
+    {
+      VT_type const* VT = object->B::VT_ptr.operator->();
+      auto [entry, inserted] = m_group_index.try_emplace(VT, m_groups.size());
+      if (inserted)
+        m_groups.push_back({VT, {}});
+      m_groups[entry->second].m_objects.push_back(object);
+    }
+    // Forget groups that became empty.
+    std::erase_if(m_groups, [](Group const& group){ return group.m_objects.empty(); });
+    if (m_group_index.size() != m_groups.size())
+    {
+      m_group_index.clear();
+      for (size_t i = 0; i < m_groups.size(); ++i)
+        m_group_index.emplace(m_groups[i].m_VT, i);
+    }
+  }
+
+  size_t number_of_groups() const { return m_groups.size(); }
+
+  // Call VT_type::*function for every object, passing args, and pass the object and the result to result_callback.
+  // For example: batch.call(&B::VT_type::_g, [&](B*, int result){ sum += result; }, 58);
+  template<typename FUNCTION, typename CALLBACK, typename... Args>
+  void call(FUNCTION VT_type::* function, CALLBACK&& result_callback, Args const&... args) const
+  {
+    for (Group const& group : m_groups)
+    {
+      FUNCTION const target = group.m_VT->*function;
+      for (B* object : group.m_objects)
+        result_callback(object, target(object, args...));
+    }
+  }
+
+  // Same, for a function that returns void, or whose result is not needed.
+  template<typename FUNCTION, typename... Args>
+  void for_each(FUNCTION VT_type::* function, Args const&... args) const
+  {
+    for (Group const& group : m_groups)
+    {
+      FUNCTION const target = group.m_VT->*function;
+      for (B* object : group.m_objects)
+        target(object, args...);
+    }
+  }
+};
+
+//=============================================================================
+// B and D of vtable_manip_test.cxx.
+
+class B
+{
+ public:
+  struct VT_type
+  {
+    int (*_g)(B* self, int n);
+    int (*_h)(B* self, double d);
+    int (*_pv)(B* self, int x, int y);  // Pure virtual function.
+  };
+
+  struct VT_impl
+  {
+    static int g(B* self, int n) { return self->m_b + n + 42; }
+    static int h(B* self, double d) { return self->m_b + d * 42; }
+
+    static constexpr VT_type VT{g, h, nullptr};
+  };
+
+  // Make a deep copy of VT_ptr.
+  virtual VT_type* clone_VT() { return VT_ptr.clone(this); }
+
+  utils::VTPtr<B> VT_ptr;
+
+  int g(int n) { return VT_ptr->_g(this, n); }
+  int h(double d) { return VT_ptr->_h(this, d); }
+  int pv(int x, int y) { return VT_ptr->_pv(this, x, y); }
+
+ private:
+  int m_b;
+
+ public:
+  B(int b) : VT_ptr(this), m_b(b) { }
+  virtual ~B() = default;
+};
+
+class D : public B
+{
+ public:
+  struct VT_type : B::VT_type
+  {
+    char const* (*_i)(char const* p, size_t n);
+  };
+
+  struct VT_impl : B::VT_impl
+  {
+    static int h(B* self, double d) { return static_cast<D*>(self)->m_d + d * 20; }            // override.
+    static int pv(B* self, int x, int y) { return static_cast<D*>(self)->m_d + x + y; }        // Implement pure virtual.
+    static char const* i(char const* p, size_t n) { return p + n; }                            // New virtual function.
+
+    static constexpr VT_type VT{{g, h, pv}, i};
+  };
+
+  // Make a deep copy of VT_ptr.
+  VT_type* clone_VT() override { return VT_ptr.clone(this); }
+
+  utils::VTPtr<D, B> VT_ptr;
+
+ private:
+  int m_d;
+
+ public:
+  D(int d, int b) : B(b), VT_ptr(this), m_d(d) { }
+
+  char const* i(char const* p, size_t n) { return VT_ptr->_i(p, n); }
+};
+
+//=============================================================================
+// Benchmark classes: K distinct types, with VTPtr and with plain virtual functions.
+
+template<int K>
+class DK : public B
+{
+ public:
+  struct VT_type : B::VT_type
+  {
+  };
+
+  struct VT_impl : B::VT_impl
+  {
+    static int g(B* self, int n) { return static_cast<DK*>(self)->m_d * (K + 1) + n; }       // override.
+    static int pv(B* self, int x, int y) { return static_cast<DK*>(self)->m_d + x * y + K; } // Implement pure virtual.
+
+    static constexpr VT_type VT{{g, h, pv}};
+  };
+
+  utils::VTPtr<DK, B> VT_ptr;
+
+ private:
+  int m_d;
+
+ public:
+  DK(int d, int b) : B(b), VT_ptr(this), m_d(d) { }
+};
+
+class V
+{
+ protected:
+  int m_b;
+
+ public:
+  V(int b) : m_b(b) { }
+  virtual ~V() = default;
+
+  virtual int g(int n) = 0;
+  virtual int pv(int x, int y) = 0;
+};
+
+template<int K>
+class VK : public V
+{
+ private:
+  int m_d;
+
+ public:
+  VK(int d, int b) : V(b), m_d(d) { }
+
+  int g(int n) override { return m_d * (K + 1) + n; }
+  int pv(int x, int y) override { return m_d + x * y + K; }
+};
+
+constexpr int max_types = 64;
+
+// Create an object of type K (DK<K> or VK<K>) for K < max_types.
+template<template<int> class T, typename Base, size_t... K>
+auto make_factories(std::index_sequence<K...>)
+{
+  return std::array<Base* (*)(int, int), sizeof...(K)>{ [](int d, int b) -> Base* { return new T<K>(d, b); }... };
+}
+
+std::array<B* (*)(int, int), max_types> const DK_factories = make_factories<DK, B>(std::make_index_sequence<max_types>{});
+std::array<V* (*)(int, int), max_types> const VK_factories = make_factories<VK, V>(std::make_index_sequence<max_types>{});
+
+template<typename FUNCTION>
+double nanoseconds_per_call(int number_of_objects, int rounds, FUNCTION function)
+{
+  double best = 1e9;
+  for (int i = 0; i < 3; ++i)
+  {
+    long total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round)
+      total += function(round);
+    auto end = std::chrono::steady_clock::now();
+    asm volatile ("" :: "r" (total));
+    best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / (static_cast<double>(number_of_objects) * rounds));
+  }
+  return best;
+}
+
+void benchmark(int number_of_types)
+{
+  constexpr int number_of_objects = 65536;
+  constexpr int rounds = 200;
+
+  // The same sequence of types and values for both hierarchies.
+  std::mt19937 gen(number_of_types);
+  std::vector<std::unique_ptr<B>> b_objects;
+  std::vector<std::unique_ptr<V>> v_objects;
+  std::vector<B*> b_pointers;
+  std::vector<V*> v_pointers;
+  for (int i = 0; i < number_of_objects; ++i)
+  {
+    int const type = gen() % number_of_types;
+    int const d = gen() % 1000;
+    b_objects.emplace_back(DK_factories[type](d, i));
+    v_objects.emplace_back(VK_factories[type](d, i));
+    b_pointers.push_back(b_objects.back().get());
+    v_pointers.push_back(v_objects.back().get());
+  }
+
+  // Check that all three give the same result.
+  long virtual_sum = 0;
+  long VT_ptr_sum = 0;
+  long batch_sum = 0;
+  for (V* object : v_pointers)
+    virtual_sum += object->g(58) + object->pv(3, 4);
+  for (B* object : b_pointers)
+    VT_ptr_sum += object->g(58) + object->pv(3, 4);
+  auto start = std::chrono::steady_clock::now();
+  VTBatch<B> batch(b_pointers);
+  auto end = std::chrono::steady_clock::now();
+  ASSERT(batch.number_of_groups() == static_cast<size_t>(number_of_types));
+  batch.call(&B::VT_type::_g, [&](B*, int result){ batch_sum += result; }, 58);
+  batch.call(&B::VT_type::_pv, [&](B*, int result){ batch_sum += result; }, 3, 4);
+  ASSERT(virtual_sum == VT_ptr_sum && VT_ptr_sum == batch_sum);
+
+  std::cout << number_of_types << " types: virtual " << nanoseconds_per_call(number_of_objects, rounds, [&](int round){
+      long sum = 0;
+      for (V* object : v_pointers)
+        sum += object->g(round);
+      return sum;
+    }) << " ns, VT_ptr " << nanoseconds_per_call(number_of_objects, rounds, [&](int round){
+      long sum = 0;
+      for (B* object : b_pointers)
+        sum += object->g(round);
+      return sum;
+    }) << " ns, VTBatch " << nanoseconds_per_call(number_of_objects, rounds, [&](int round){
+      long sum = 0;
+      batch.call(&B::VT_type::_g, [&](B*, int result){ sum += result; }, round);
+      return sum;
+    }) << " ns per call; grouping took " <<
+    std::chrono::duration<double, std::nano>(end - start).count() / number_of_objects << " ns per object." << std::endl;
+}
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  // The objects of vtable_manip_test.cxx.
+  B b1(123);
+  B b2(124);
+  D d1(234, 345);
+  D d2(235, 346);
+  D d3(236, 347);
+  std::vector<B*> objects = { &d1, &b1, &d2, &b2, &d3 };
+  VTBatch<B> batch(objects);
+  ASSERT(batch.number_of_groups() == 2);
+  int calls = 0;
+  batch.call(&B::VT_type::_g, [&](B* object, int result){ ASSERT(result == object->g(58)); ++calls; }, 58);
+  batch.call(&B::VT_type::_h, [&](B* object, int result){ ASSERT(result == object->h(5)); ++calls; }, 5.0);
+  ASSERT(calls == 10);
+  ASSERT(d1.pv(33, 66) == 333);
+
+  // Only the D objects implement pv.
+  std::vector<B*> d_objects = { &d1, &d2, &d3 };
+  batch.assign(d_objects);
+  ASSERT(batch.number_of_groups() == 1);
+  batch.call(&B::VT_type::_pv, [&](B* object, int result){ ASSERT(result == object->pv(33, 66)); ++calls; }, 33, 66);
+  ASSERT(calls == 13);
+
+  // An object with a cloned VT gets a group of its own.
+  D::VT_type* VT = d2.clone_VT();
+  VT->_g = [](B*, int n){ return -n; };
+  batch.assign(d_objects);
+  ASSERT(batch.number_of_groups() == 2);
+  batch.call(&B::VT_type::_g, [&](B* object, int result){ ASSERT(result == (object == &d2 ? -58 : object->g(58))); ++calls; }, 58);
+  ASSERT(calls == 16);
+
+  for (int number_of_types : { 2, 8, 64 })
+    benchmark(number_of_types);
+
+  Dout(dc::notice, "Success");
+}